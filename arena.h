@@ -9,25 +9,152 @@
 #include <stdlib.h>
 #include "allocator.h"
 
+// Arenas are passed around by value for scratch memory, a copy that grows past the end of its chunk
+// links a new chunk after the current one. Rolling back to an earlier copy leaves the later chunks
+// in the chain so they get reused by the next allocation that runs out of space.
+
+typedef struct ArenaChunk ArenaChunk;
+
+struct ArenaChunk
+{
+	ArenaChunk *next;
+	size_t size;   // Including this header
+	size_t offset; // Usable bytes in all chunks before this one
+};
+
+typedef struct
+{
+	const char *name;
+	Allocator *allocator;					   // Chained: chunks are allocated on demand from this allocator
+	bool (*commit)(char *ptr, size_t size); // Virtual: pages inside [base, reserve_end) are committed on demand
+	size_t chunk_size;
+	size_t limit; // 0 for no limit
+	char *base;
+	char *reserve_end;
+	char *commit_end;
+	ArenaChunk *head;
+	int chunk_count;
+	size_t reserved; // Bytes taken from the allocator or committed
+	size_t peak;	 // High-water mark of bytes in use
+} ArenaInfo;
+
 typedef struct
 {
 	char *beg;
 	char *end;
 	jmp_buf *jmp_oom;
+	ArenaChunk *chunk;
+	ArenaInfo *info;
 } Arena;
 
+#define ARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+
+static char *arena_chunk_data_(ArenaChunk *chunk)
+{
+	return (char *)(chunk + 1);
+}
+
+static size_t arena_used(Arena *a)
+{
+	if(!a->info)
+		return 0;
+	if(a->chunk)
+		return a->chunk->offset + (a->beg - arena_chunk_data_(a->chunk));
+	if(a->info->base && a->beg)
+		return a->beg - a->info->base;
+	return 0;
+}
+
+static bool arena_grow_chained_(Arena *a, size_t need)
+{
+	ArenaInfo *info = a->info;
+	ArenaChunk *prev = a->chunk;
+	ArenaChunk *next = prev ? prev->next : info->head;
+	ArenaChunk *chunk = NULL;
+	if(next && next->size - sizeof(ArenaChunk) >= need)
+	{
+		chunk = next;
+	}
+	else
+	{
+		size_t n = info->chunk_size;
+		if(n < need + sizeof(ArenaChunk))
+			n = need + sizeof(ArenaChunk);
+		if(info->limit && info->reserved + n > info->limit)
+			return false;
+		chunk = (ArenaChunk *)info->allocator->malloc(info->allocator->ctx, n);
+		if(!chunk)
+			return false;
+		chunk->size = n;
+		chunk->next = next;
+		if(prev)
+			prev->next = chunk;
+		else
+			info->head = chunk;
+		info->reserved += n;
+		info->chunk_count++;
+	}
+	chunk->offset = prev ? prev->offset + (prev->size - sizeof(ArenaChunk)) : 0;
+	a->chunk = chunk;
+	a->beg = arena_chunk_data_(chunk);
+	a->end = (char *)chunk + chunk->size;
+	return true;
+}
+
+static bool arena_grow_virtual_(Arena *a, size_t need)
+{
+	ArenaInfo *info = a->info;
+	if(a->end < info->commit_end)
+		a->end = info->commit_end;
+	if((size_t)(a->end - a->beg) >= need)
+		return true;
+	size_t step = info->chunk_size;
+	size_t missing = need - (a->end - a->beg);
+	size_t n = (missing + step - 1) / step * step;
+	if(n > (size_t)(info->reserve_end - info->commit_end))
+		n = info->reserve_end - info->commit_end;
+	if(n < missing || !info->commit(info->commit_end, n))
+		return false;
+	info->commit_end += n;
+	info->reserved += n;
+	a->end = info->commit_end;
+	return true;
+}
+
+static bool arena_grow_(Arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count)
+{
+	if(!a->info || count > (PTRDIFF_MAX - align) / size)
+		return false;
+	size_t need = size * count + align;
+	if(a->info->allocator)
+		return arena_grow_chained_(a, need);
+	if(a->info->commit)
+		return arena_grow_virtual_(a, need);
+	return false;
+}
+
 static void *arena_allocate_memory_(Arena *a, ptrdiff_t size, ptrdiff_t align, ptrdiff_t count)
 {
 	ptrdiff_t padding = -(uintptr_t)a->beg & (align - 1);
 	ptrdiff_t available = a->end - a->beg - padding;
 	if(available < 0 || count > available / size)
 	{
-		if(a->jmp_oom)
-			longjmp(*a->jmp_oom, 1);
-		return NULL;
+		if(!arena_grow_(a, size, align, count))
+		{
+			if(a->jmp_oom)
+				longjmp(*a->jmp_oom, 1);
+			return NULL;
+		}
+		padding = -(uintptr_t)a->beg & (align - 1);
 	}
 	void *p = a->beg + padding;
 	a->beg += padding + count * size;
+	if(a->info)
+	{
+		size_t used = arena_used(a);
+		if(used > a->info->peak)
+			a->info->peak = used;
+	}
 	return memset(p, 0, count * size);
 }
 #define new(a, t, n) (t *)arena_allocate_memory_(a, sizeof(t), _Alignof(t), n)
@@ -37,6 +164,84 @@ static void arena_init(Arena *a, char *buffer, size_t size)
 	a->beg = buffer;
 	a->end = buffer + size;
 	a->jmp_oom = NULL;
+	a->chunk = NULL;
+	a->info = NULL;
+}
+
+// Fixed buffer, only used to keep track of statistics
+static void arena_init_fixed(Arena *a, ArenaInfo *info, const char *name, char *buffer, size_t size)
+{
+	arena_init(a, buffer, size);
+	memset(info, 0, sizeof(ArenaInfo));
+	info->name = name;
+	info->base = buffer;
+	info->reserved = size;
+	a->info = info;
+}
+
+// Starts out empty, the first allocation links the first chunk
+static void arena_init_chained(Arena *a, ArenaInfo *info, const char *name, Allocator *allocator, size_t chunk_size, size_t limit)
+{
+	arena_init(a, NULL, 0);
+	memset(info, 0, sizeof(ArenaInfo));
+	info->name = name;
+	info->allocator = allocator;
+	info->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+	info->limit = limit;
+	a->info = info;
+}
+
+// Address space is reserved up front, pages get committed in steps of chunk_size as they're needed
+static void arena_init_virtual(Arena *a,
+							   ArenaInfo *info,
+							   const char *name,
+							   char *reserved,
+							   size_t reserve_size,
+							   size_t chunk_size,
+							   bool (*commit)(char *, size_t))
+{
+	arena_init(a, reserved, 0);
+	memset(info, 0, sizeof(ArenaInfo));
+	info->name = name;
+	info->commit = commit;
+	info->chunk_size = chunk_size ? chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+	info->base = reserved;
+	info->reserve_end = reserved + reserve_size;
+	info->commit_end = reserved;
+	a->info = info;
+}
+
+// Gives chained chunks back to the allocator, the arena can't be used afterwards
+static void arena_release(ArenaInfo *info)
+{
+	if(!info->allocator)
+		return;
+	for(ArenaChunk *it = info->head; it;)
+	{
+		ArenaChunk *next = it->next;
+		info->allocator->free(info->allocator->ctx, it);
+		it = next;
+	}
+	info->head = NULL;
+	info->chunk_count = 0;
+	info->reserved = 0;
+}
+
+// Gives chained chunks past the current position of the arena back to the allocator
+static void arena_trim(Arena *a)
+{
+	ArenaInfo *info = a->info;
+	if(!info || !info->allocator)
+		return;
+	ArenaChunk **it = a->chunk ? &a->chunk->next : &info->head;
+	while(*it)
+	{
+		ArenaChunk *next = (*it)->next;
+		info->reserved -= (*it)->size;
+		info->chunk_count--;
+		info->allocator->free(info->allocator->ctx, *it);
+		*it = next;
+	}
 }
 
 static float arena_available_mib(Arena *a)
@@ -47,8 +252,7 @@ static float arena_available_mib(Arena *a)
 static Arena arena_split(Arena *base, int size)
 {
 	Arena a = {0};
-	arena_init(&a, base->beg, size);
-	base->beg += size;
+	arena_init(&a, new(base, char, size), size);
 	a.jmp_oom = base->jmp_oom;
 	return a;
 }
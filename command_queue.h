@@ -0,0 +1,176 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include "allocator.h"
+
+// Bounded multi-producer single-consumer ring of fixed size entries
+// Any thread may push, only the thread that owns the queue pops. Every cell carries a sequence number which is
+// pos while the cell is free to be written for position pos and pos + 1 once the entry for pos is written.
+// Producers claim a position with a compare and swap on the head and publish the cell by bumping its sequence.
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+
+static int64_t atomic_load_acquire(volatile int64_t *p)
+{
+	return _InterlockedCompareExchange64(p, 0, 0);
+}
+
+static void atomic_store_release(volatile int64_t *p, int64_t v)
+{
+	_InterlockedExchange64(p, v);
+}
+
+static bool atomic_compare_exchange(volatile int64_t *p, int64_t *expected, int64_t desired)
+{
+	int64_t prev = _InterlockedCompareExchange64(p, desired, *expected);
+	if(prev == *expected)
+		return true;
+	*expected = prev;
+	return false;
+}
+
+static void atomic_increment(volatile int64_t *p)
+{
+	_InterlockedExchangeAdd64(p, 1);
+}
+#else
+static int64_t atomic_load_acquire(volatile int64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void atomic_store_release(volatile int64_t *p, int64_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static bool atomic_compare_exchange(volatile int64_t *p, int64_t *expected, int64_t desired)
+{
+	return __atomic_compare_exchange_n(p, expected, desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void atomic_increment(volatile int64_t *p)
+{
+	__atomic_fetch_add(p, 1, __ATOMIC_RELAXED);
+}
+#endif
+
+#define COMMAND_QUEUE_CACHE_LINE (64)
+
+typedef struct
+{
+	volatile int64_t sequence;
+	int64_t padding; // Keeps entries 16 byte aligned
+} CommandQueueCell;
+
+typedef struct
+{
+	Allocator *allocator;
+	char *cells;
+	size_t cell_size; // Cell header followed by the entry
+	int64_t mask;
+	char pad0[COMMAND_QUEUE_CACHE_LINE]; // Producers and the consumer write different cache lines
+	volatile int64_t head; // Next position producers claim
+	volatile int64_t pushed;
+	volatile int64_t rejected; // Pushes that failed because the queue was full
+	char pad1[COMMAND_QUEUE_CACHE_LINE];
+	int64_t tail; // Next position the consumer pops, only touched by the consumer
+	int64_t popped;
+	int64_t high_water; // Most entries that were pending at once when the consumer looked
+} CommandQueue;
+
+static CommandQueueCell *command_queue_cell(CommandQueue *q, int64_t pos)
+{
+	return (CommandQueueCell *)(q->cells + (size_t)(pos & q->mask) * q->cell_size);
+}
+
+// Capacity is rounded up to a power of two
+static bool command_queue_init(CommandQueue *q, Allocator *allocator, int capacity, size_t entry_size)
+{
+	memset(q, 0, sizeof(CommandQueue));
+	int64_t n = 1;
+	while(n < capacity)
+		n *= 2;
+	q->allocator = allocator;
+	q->cell_size = (sizeof(CommandQueueCell) + entry_size + 15) & ~(size_t)15;
+	q->cells = allocator->malloc(allocator->ctx, q->cell_size * (size_t)n);
+	if(!q->cells)
+		return false;
+	q->mask = n - 1;
+	for(int64_t i = 0; i < n; ++i)
+		command_queue_cell(q, i)->sequence = i;
+	return true;
+}
+
+static void command_queue_destroy(CommandQueue *q)
+{
+	if(q->cells)
+		q->allocator->free(q->allocator->ctx, q->cells);
+	q->cells = NULL;
+}
+
+static int64_t command_queue_capacity(CommandQueue *q)
+{
+	return q->cells ? q->mask + 1 : 0;
+}
+
+// Claims the next cell, NULL if the queue is full. The entry has to be published with command_queue_commit
+static void *command_queue_reserve(CommandQueue *q, int64_t *pos)
+{
+	int64_t p = atomic_load_acquire(&q->head);
+	for(;;)
+	{
+		CommandQueueCell *cell = command_queue_cell(q, p);
+		int64_t diff = atomic_load_acquire(&cell->sequence) - p;
+		if(diff == 0)
+		{
+			if(atomic_compare_exchange(&q->head, &p, p + 1))
+			{
+				*pos = p;
+				return cell + 1;
+			}
+		}
+		else if(diff < 0)
+		{
+			atomic_increment(&q->rejected);
+			return NULL;
+		}
+		else
+		{
+			p = atomic_load_acquire(&q->head);
+		}
+	}
+}
+
+static void command_queue_commit(CommandQueue *q, void *entry, int64_t pos)
+{
+	CommandQueueCell *cell = (CommandQueueCell *)entry - 1;
+	atomic_store_release(&cell->sequence, pos + 1);
+	atomic_increment(&q->pushed);
+}
+
+// Oldest published entry, NULL if there's none yet
+static void *command_queue_peek(CommandQueue *q)
+{
+	CommandQueueCell *cell = command_queue_cell(q, q->tail);
+	if(atomic_load_acquire(&cell->sequence) != q->tail + 1)
+		return NULL;
+	return cell + 1;
+}
+
+static void command_queue_pop(CommandQueue *q)
+{
+	CommandQueueCell *cell = command_queue_cell(q, q->tail);
+	atomic_store_release(&cell->sequence, q->tail + q->mask + 1);
+	q->tail++;
+	q->popped++;
+}
+
+// Entries claimed but not popped yet, some of them may still be being written
+static int64_t command_queue_pending(CommandQueue *q)
+{
+	return atomic_load_acquire(&q->head) - q->tail;
+}
@@ -904,8 +904,92 @@ IMPL_VISIT(ASTBinaryExpr)
 	}
 }
 
+static bool is_string_literal(ASTNode *n)
+{
+	return n->type == AST_LITERAL && n->ast_literal_data.type == AST_LITERAL_TYPE_STRING;
+}
+
+static int intrinsic(Compiler *c, ASTCallExpr *n)
+{
+	if(c->flags & GSC_COMPILE_FLAG_NO_INTRINSICS)
+		return -1;
+	if(n->callee->type != AST_IDENTIFIER || n->object || n->threaded)
+		return -1;
+	const char *name = lowercase(c, n->callee->ast_identifier_data.name);
+	for(int i = 0; i < INTRINSIC_MAX; ++i)
+	{
+		if(intrinsics[i].argc == n->numarguments && !strcmp(intrinsics[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+// self notify/waittill/endon/waittillmatch(...) go straight to the event system
+static Opcode event_opcode(Compiler *c, ASTCallExpr *n)
+{
+	if(c->flags & GSC_COMPILE_FLAG_NO_INTRINSICS)
+		return OP_INVALID;
+	if(n->callee->type != AST_IDENTIFIER || !n->object || n->threaded || n->numarguments < 1)
+		return OP_INVALID;
+	const char *name = lowercase(c, n->callee->ast_identifier_data.name);
+	if(!strcmp(name, "notify"))
+		return OP_NOTIFY;
+	if(!strcmp(name, "waittill"))
+		return OP_WAITTILL;
+	if(!strcmp(name, "endon") && n->numarguments == 1)
+		return OP_ENDON;
+	// Only with a constant name, the key is prefixed
+	if(!strcmp(name, "waittillmatch") && n->numarguments == 1 && is_string_literal(n->arguments[0]))
+		return OP_WAITTILL;
+	return OP_INVALID;
+}
+
+static void event_call(Compiler *c, ASTCallExpr *n, Opcode op)
+{
+	for(size_t i = n->numarguments - 1; i > 0; --i)
+	{
+		if(op == OP_WAITTILL)
+			identifier(c, n->arguments[i]);
+		else
+			visit(n->arguments[i]);
+	}
+	Operand name = NONE;
+	ASTNode *event = n->arguments[0];
+	if(is_string_literal(event))
+	{
+		const char *str = event->ast_literal_data.value.string;
+		if(!strcmp(lowercase(c, n->callee->ast_identifier_data.name), "waittillmatch"))
+		{
+			snprintf(c->string, sizeof(c->string), "$nt_%s", str);
+			str = c->string;
+		}
+		name = string(c, str);
+	}
+	else
+	{
+		visit(event);
+	}
+	visit(n->object);
+	emit2(c, op, name, integer(n->numarguments - 1));
+}
+
 IMPL_VISIT(ASTCallExpr)
 {
+	Opcode event_op = event_opcode(c, n);
+	if(event_op != OP_INVALID)
+	{
+		event_call(c, n, event_op);
+		return;
+	}
+	int intrinsic_index = intrinsic(c, n);
+	if(intrinsic_index != -1)
+	{
+		// Same evaluation order as a call, the first argument ends up on top
+		for(size_t i = 0; i < n->numarguments; ++i)
+			visit(n->arguments[n->numarguments - i - 1]);
+		emit2(c, OP_INTRINSIC_CALL, integer(intrinsic_index), string(c, intrinsics[intrinsic_index].name));
+		return;
+	}
 	bool pass_args_as_ref = false;
 	if(n->callee->type == AST_IDENTIFIER)
 	{
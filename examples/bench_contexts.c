@@ -0,0 +1,145 @@
+// Creates N contexts side by side, runs a trivial script in each and reports how much memory every context costs
+// bench_contexts [count] [memory mode]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <gsc.h>
+
+typedef struct
+{
+	size_t size;
+	size_t padding;
+} AllocationHeader;
+
+static size_t bytes_in_use;
+static size_t peak_bytes;
+static size_t allocation_count;
+
+static void *allocate_memory(void *ctx, int size)
+{
+	AllocationHeader *h = malloc(sizeof(AllocationHeader) + size);
+	if(!h)
+		return NULL;
+	h->size = size;
+	bytes_in_use += size;
+	if(bytes_in_use > peak_bytes)
+		peak_bytes = bytes_in_use;
+	allocation_count++;
+	return h + 1;
+}
+
+static void free_memory(void *ctx, void *ptr)
+{
+	if(!ptr)
+		return;
+	AllocationHeader *h = (AllocationHeader *)ptr - 1;
+	bytes_in_use -= h->size;
+	free(h);
+}
+
+static const char *script = "main()\n"
+							"{\n"
+							"	total = 0;\n"
+							"	for(i = 0; i < 10; i++)\n"
+							"		total += i;\n"
+							"	level.total = total;\n"
+							"	wait 0.05;\n"
+							"}\n";
+
+static const char *read_file(void *ctx, const char *filename, int *status)
+{
+	*status = GSC_OK;
+	return script;
+}
+
+static double now_ms(void)
+{
+	return (double)clock() * 1000.0 / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1000;
+	int mode = argc > 2 ? atoi(argv[2]) : GSC_MEMORY_CHAINED;
+	if(count <= 0)
+		count = 1;
+
+	gsc_Context **contexts = calloc(count, sizeof(gsc_Context *));
+	gsc_CreateOptions opts = { .allocate_memory = allocate_memory,
+							   .free_memory = free_memory,
+							   .read_file = read_file,
+							   .main_memory_size = 32 * 1024 * 1024,
+							   .temp_memory_size = 16 * 1024 * 1024,
+							   .string_table_memory_size = 1024 * 1024,
+							   .max_threads = 1024,
+							   .default_self = "level",
+							   .memory_mode = mode,
+							   .memory_chunk_size = 16 * 1024 };
+
+	double start = now_ms();
+	for(int i = 0; i < count; ++i)
+	{
+		gsc_Context *ctx = gsc_create(opts);
+		if(!ctx)
+		{
+			fprintf(stderr, "Failed to create context %d\n", i);
+			return 1;
+		}
+		gsc_add_tagged_object(ctx, "#level");
+		gsc_set_global(ctx, "level");
+		if(gsc_compile(ctx, "bench", 0) != GSC_OK || gsc_link(ctx) != GSC_OK)
+		{
+			fprintf(stderr, "Failed to compile script in context %d\n", i);
+			return 1;
+		}
+		gsc_call(ctx, "bench", "main", 0);
+		contexts[i] = ctx;
+	}
+	double created = now_ms();
+
+	for(int i = 0; i < count; ++i)
+	{
+		while(GSC_OK != gsc_update(contexts[i], 1.f / 20.f))
+		{
+		}
+	}
+	double finished = now_ms();
+
+	gsc_MemoryStats stats;
+	memset(&stats, 0, sizeof(stats));
+	gsc_memory_stats(contexts[0], &stats);
+
+	printf("%d contexts (memory mode %d)\n", count, mode);
+	printf("create+compile: %.2f ms, run: %.2f ms\n", created - start, finished - created);
+	printf("host memory in use: %zu bytes, peak: %zu bytes, %zu allocations\n", bytes_in_use, peak_bytes, allocation_count);
+	printf("bytes per context: %zu\n", bytes_in_use / count);
+	for(int i = 0; i < stats.arena_count; ++i)
+	{
+		gsc_ArenaStats *a = &stats.arenas[i];
+		printf("  arena %-10s chunks:%d reserved:%zu used:%zu peak:%zu\n",
+			   a->name,
+			   a->chunk_count,
+			   (size_t)a->reserved_bytes,
+			   (size_t)a->used_bytes,
+			   (size_t)a->peak_bytes);
+	}
+	for(int i = 0; i < stats.slab_count; ++i)
+	{
+		gsc_SlabStats *s = &stats.slabs[i];
+		printf("  slab  %-12s chunks:%d reserved:%zu live:%zu peak:%zu\n",
+			   s->name,
+			   s->chunk_count,
+			   (size_t)s->reserved_bytes,
+			   (size_t)s->live,
+			   (size_t)s->peak);
+	}
+
+	for(int i = 0; i < count; ++i)
+	{
+		gsc_destroy(contexts[i]);
+	}
+	free(contexts);
+	printf("host memory after destroy: %zu bytes\n", bytes_in_use);
+	return 0;
+}
@@ -200,7 +200,7 @@ static float dot(float *a, float *b)
 
 static float length2(vec3 v)
 {
-	return sqrtf(dot(v, v));
+	return dot(v, v);
 }
 
 static float length(vec3 v)
@@ -223,60 +223,38 @@ static float radians(float f)
 	return f * DEG2RAD;
 }
 
-static int vectordot(gsc_Context *ctx)
+static void vectordot(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	vec3 a, b;
-	gsc_get_vec3(ctx, 0, a);
-	gsc_get_vec3(ctx, 0, b);
-	gsc_add_float(ctx, dot(a, b) / (length(a) * length(b)));
-	return 1;
+	result->f = dot((float *)args[0].v, (float *)args[1].v);
 }
 
-static int vectornormalize(gsc_Context *ctx)
+static void vectornormalize(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	float v[3];
-	gsc_get_vec3(ctx, 0, v);
-	normalize(v);
-	gsc_add_vec3(ctx, v);
-	return 1;
+	memcpy(result->v, args[0].v, sizeof(vec3));
+	normalize(result->v);
 }
-static int vectorscale(gsc_Context *ctx)
+
+static void vectorscale(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	float v[3];
-	gsc_get_vec3(ctx, 0, v);
-	float scale = gsc_get_float(ctx, 1);
 	for(int i = 0; i < 3; ++i)
-		v[i] *= scale;
-	gsc_add_vec3(ctx, v);
-	return 1;
+		result->v[i] = args[0].v[i] * args[1].f;
 }
 
-static int vectortoangles(gsc_Context *ctx)
+static void vectortoangles(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	float v[3];
-	gsc_get_vec3(ctx, 0, v);
-	float pitch = asinf(-v[1]);
-	float yaw = atan2f(v[0], v[2]);
-	float angles[3];
-	angles[1] = yaw;
-	angles[0] = pitch;
-	angles[2] = 0.f;
-	gsc_add_vec3(ctx, angles);
-	return 1;
+	const float *v = args[0].v;
+	result->v[0] = asinf(-v[1]); // pitch
+	result->v[1] = atan2f(v[0], v[2]); // yaw
+	result->v[2] = 0.f;
 }
 
-static int anglestoforward(gsc_Context *ctx)
+static void anglestoforward(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	float v[3];
-	gsc_get_vec3(ctx, 0, v);
-	float yaw = v[1];
-	float forward[3];
-	forward[0] = cosf(radians(yaw));
-	forward[1] = sinf(radians(yaw));
-	forward[2] = 0.f;
-	normalize(forward);
-	gsc_add_vec3(ctx, forward);
-	return 1;
+	float yaw = args[0].v[1];
+	result->v[0] = cosf(radians(yaw));
+	result->v[1] = sinf(radians(yaw));
+	result->v[2] = 0.f;
+	normalize(result->v);
 }
 
 static int tolower_(gsc_Context *ctx)
@@ -324,75 +302,57 @@ static uint32_t xorshift1() // xorshift1
 	return state;
 }
 
-static int int_(gsc_Context *ctx)
+static void int_(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	int i = gsc_get_int(ctx, 0);
-	gsc_add_int(ctx, i);
-	return 1;
+	result->i = (int)args[0].i;
 }
 
-static int sin_(gsc_Context *ctx)
+static void sin_(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	float f = gsc_get_float(ctx, 0);
-	gsc_add_float(ctx, sinf(f));
-	return 1;
+	result->f = sinf(args[0].f);
 }
 
-static int cos_(gsc_Context *ctx)
+static void cos_(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	float f = gsc_get_float(ctx, 0);
-	gsc_add_float(ctx, cosf(f));
-	return 1;
+	result->f = cosf(args[0].f);
 }
 
-static int float_(gsc_Context *ctx)
+static void float_(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	float f = gsc_get_float(ctx, 0);
-	gsc_add_float(ctx, f);
-	return 1;
+	result->f = args[0].f;
 }
 
-static int randomint(gsc_Context *ctx)
+static void randomint(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	int max_ = gsc_get_int(ctx, 0);
-	int r = xorshift1() % (max_ + 1);
-	gsc_add_int(ctx, r);
-	return 1;
+	int max_ = args[0].i;
+	result->i = xorshift1() % (max_ + 1);
 }
 
-static int randomfloat(gsc_Context *ctx)
+static void randomfloat(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	float max_ = gsc_get_float(ctx, 0);
-	float r = ((float)xorshift1() / (float)UINT32_MAX) * max_;
-	gsc_add_float(ctx, r);
-	return 1;
+	result->f = ((float)xorshift1() / (float)UINT32_MAX) * args[0].f;
 }
 
-static int distance_(gsc_Context *ctx)
+static void distance_(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	vec3 a, b;
-	gsc_get_vec3(ctx, 0, a);
-	gsc_get_vec3(ctx, 0, b);
-	gsc_add_float(ctx, sqrtf(dot(a, b)));
-	return 1;
+	vec3 d;
+	for(int i = 0; i < 3; ++i)
+		d[i] = args[0].v[i] - args[1].v[i];
+	result->f = length(d);
 }
 
-static int randomintrange(gsc_Context *ctx)
+static void randomintrange(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	int min = gsc_get_int(ctx, 0);
-	int max = gsc_get_int(ctx, 1);
-	int64_t r = min + xorshift1() % (max - min);
-	gsc_add_int(ctx, r);
-	return 1;
+	int min = args[0].i;
+	int max = args[1].i;
+	result->i = min + xorshift1() % (max - min);
 }
 
-static int randomfloatrange(gsc_Context *ctx)
+static void randomfloatrange(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result)
 {
-	float min = gsc_get_float(ctx, 0);
-	float max = gsc_get_float(ctx, 1);
-	float r = min + ((float)xorshift1() / (float)UINT32_MAX) * (max - min);
-	gsc_add_float(ctx, r);
-	return 1;
+	float min = args[0].f;
+	float max = args[1].f;
+	result->f = min + ((float)xorshift1() / (float)UINT32_MAX) * (max - min);
 }
 
 static int assertex(gsc_Context *ctx)
@@ -439,31 +399,46 @@ static gsc_FunctionEntry functions[] = { { "getchar", f_getchar },
 										 { "gettime", gettime },
 										 { "assertex", assertex },
 										 { "assert", f_assert },
-										 { "vectornormalize", vectornormalize },
-										 { "vectordot", vectordot },
-										 { "vectorscale", vectorscale },
-										 { "vectortoangles", vectortoangles },
-										 { "anglestoforward", anglestoforward },
 										 { "toupper", toupper_ },
 										 { "tolower", tolower_ },
 										 { "strtok", f_strtok },
 										 { "isdefined", isdefined },
 										 { "println", println },
-										 { "sin", sin_ },
-										 { "cos", cos_ },
-										 { "randomint", randomint },
-										 { "int", int_ },
-										 { "float", float_ },
-										 { "randomfloat", randomfloat },
-										 { "distance", distance_ },
-										 { "randomfloatrange", randomfloatrange },
-										 { "randomintrange", randomintrange },
 										 { "typeof", typeof_ },
 										 { "proxy", proxy_ },
 										 { NULL, 0 } };
 
+static struct
+{
+	const char *name;
+	const char *signature;
+	gsc_TypedFunction function;
+} typed_functions[] = { { "vectornormalize", "v>v", vectornormalize },
+						{ "vectordot", "vv>f", vectordot },
+						{ "vectorscale", "vf>v", vectorscale },
+						{ "vectortoangles", "v>v", vectortoangles },
+						{ "anglestoforward", "v>v", anglestoforward },
+						{ "distance", "vv>f", distance_ },
+						{ "sin", "f>f", sin_ },
+						{ "cos", "f>f", cos_ },
+						{ "int", "i>i", int_ },
+						{ "float", "f>f", float_ },
+						{ "randomint", "i>i", randomint },
+						{ "randomfloat", "f>f", randomfloat },
+						{ "randomintrange", "ii>i", randomintrange },
+						{ "randomfloatrange", "ff>f", randomfloatrange },
+						{ NULL, NULL, 0 } };
+
+// int and float aren't in here, the typed versions above only take their own type where the intrinsics convert
+static const char *intrinsic_functions[] = { "isdefined", "length", "lengthsquared", "distance", "distancesquared",
+											 "vectordot", "vectornormalize", NULL };
+
 void register_script_functions(gsc_Context *ctx)
 {
 	for(int i = 0; functions[i].name; i++)
 		gsc_register_function(ctx, NULL, functions[i].name, functions[i].function);
+	for(int i = 0; typed_functions[i].name; i++)
+		gsc_register_typed_function(ctx, typed_functions[i].name, typed_functions[i].signature, typed_functions[i].function);
+	for(int i = 0; intrinsic_functions[i]; i++)
+		gsc_register_intrinsic(ctx, intrinsic_functions[i]);
 }
\ No newline at end of file
@@ -48,6 +48,14 @@ extern "C"
 	};
 
 	typedef struct gsc_Context gsc_Context;
+
+	enum
+	{
+		GSC_MEMORY_FIXED,	// One block of main_memory_size is allocated up front and carved up
+		GSC_MEMORY_CHAINED, // Arenas chain chunks from allocate_memory on demand, sizes act as limits (0 for none)
+		GSC_MEMORY_VIRTUAL	// Arenas reserve address space of the given sizes and commit pages on demand
+	};
+
 	typedef struct
 	{
 		void *(*allocate_memory)(void *ctx, int size);							// Allocate memory of specified size
@@ -60,23 +68,131 @@ extern "C"
 		int string_table_memory_size;
 		const char *default_self;
 		int max_threads;
+		int memory_mode;
+		int memory_chunk_size; // Granularity arenas grow with, 0 for the default
+		int command_queue_size; // Commands that can be pending for gsc_post_*, rounded up to a power of two, 0 for no queue
 	} gsc_CreateOptions;
 
 	GSC_API gsc_Context *gsc_create(gsc_CreateOptions options);
 	GSC_API void gsc_destroy(gsc_Context *ctx);
 	GSC_API void gsc_error(gsc_Context *ctx, const char *fmt, ...);
 
+#define GSC_MAX_SLAB_CLASSES (16)
+
+	typedef struct
+	{
+		const char *name;
+		int slot_size;
+		int chunk_count;
+		int64_t reserved_bytes; // Bytes taken from the allocator for chunks
+		int64_t live;			// Slots currently in use
+		int64_t peak;			// Highest amount of slots in use at once
+		int64_t allocations;	// Total amount of allocations
+	} gsc_SlabStats;
+
+#define GSC_MAX_ARENAS (8)
+
+	typedef struct
+	{
+		const char *name;
+		int chunk_count;
+		int64_t reserved_bytes; // Bytes taken from the allocator or committed
+		int64_t used_bytes;
+		int64_t peak_bytes; // High-water mark
+	} gsc_ArenaStats;
+
+	typedef struct
+	{
+		gsc_SlabStats slabs[GSC_MAX_SLAB_CLASSES];
+		int slab_count;
+		gsc_ArenaStats arenas[GSC_MAX_ARENAS];
+		int arena_count;
+	} gsc_MemoryStats;
+
+	GSC_API void gsc_memory_stats(gsc_Context *ctx, gsc_MemoryStats *stats);
+
 	GSC_API int gsc_link(gsc_Context *ctx);
 
 	#define GSC_COMPILE_FLAG_NONE (0)
 	#define GSC_COMPILE_FLAG_PRINT_EXPRESSION (1)
+	#define GSC_COMPILE_FLAG_NO_INTRINSICS (2) // Call isdefined, int, distance, notify, waittill etc. as regular functions
 
 	GSC_API int gsc_compile(gsc_Context *ctx, const char *filename, int flags);
 	GSC_API const char *gsc_next_compile_dependency(gsc_Context *ctx);
 	GSC_API void *gsc_temp_alloc(gsc_Context *ctx, int size);
 	GSC_API int gsc_update(gsc_Context *ctx, float dt);
+
+	typedef struct
+	{
+		int64_t max_instructions; // 0 for no limit
+		double max_time_ms;		  // 0 for no limit
+	} gsc_UpdateBudget;
+
+	typedef struct
+	{
+		int frame_complete;				// 0 if the budget ran out before all threads ran
+		int64_t instructions;			// Executed during this update
+		int threads_run;
+		int threads_deferred;			// Left to run or pushed to the next frame when the budget ran out
+		int preempted_thread;			// Id of the thread that was stopped, -1 if none
+		int64_t preempted_instructions; // Executed by that thread this frame so far
+	} gsc_UpdateReport;
+
+	// Threads run highest priority first. When an update runs out of budget, low priority threads that didn't get
+	// to finish are pushed to the next frame instead, threads that keep getting pushed back are promoted a class.
+	enum
+	{
+		GSC_PRIORITY_HIGH,
+		GSC_PRIORITY_NORMAL,
+		GSC_PRIORITY_LOW,
+		GSC_PRIORITY_MAX
+	};
+
+	typedef struct
+	{
+		int64_t threads;	  // Alive in this class
+		int64_t runs;		  // Times a thread of this class ran
+		int64_t instructions; // Executed by threads of this class
+		int64_t deferred;	  // Times a thread was pushed to the next frame
+		int64_t promoted;	  // Times a thread ran a class higher because it was deferred too often
+	} gsc_PriorityStats;
+
+	typedef struct
+	{
+		gsc_PriorityStats classes[GSC_PRIORITY_MAX];
+		int64_t threads_spawned; // In total
+		int64_t batch_spawned;	 // By gsc_spawn_threads
+		double batch_spawn_ms;	 // Time spent in gsc_spawn_threads
+	} gsc_SchedulerStats;
+
+	GSC_API void gsc_scheduler_stats(gsc_Context *ctx, gsc_SchedulerStats *stats);
+	// Sets the priority of the running thread when called from a function, otherwise that of threads started with gsc_call
+	GSC_API void gsc_set_thread_priority(gsc_Context *ctx, int priority);
+
+	// Like gsc_update, but stops at the next backward jump or call once the budget runs out.
+	// The rest of the frame runs on the next update in the same order, time only advances once the frame completes.
+	GSC_API int gsc_update_budgeted(gsc_Context *ctx, float dt, const gsc_UpdateBudget *budget, gsc_UpdateReport *report);
 	GSC_API int gsc_call(gsc_Context *ctx, const char *file, const char *function, int nargs);
 	GSC_API int gsc_call_method(gsc_Context *ctx, const char *file, const char *function, int nargs);
+
+	typedef struct gsc_ScriptFunction gsc_ScriptFunction;
+	// Look up a script function once to invoke it, NULL if it doesn't exist. Valid after gsc_link
+	GSC_API gsc_ScriptFunction *gsc_find_function(gsc_Context *ctx, const char *file, const char *function);
+	// Run a script function to completion right away with the arguments on the stack (pushed in order).
+	// The result is left on the stack in their place. The function must not wait, calls can be nested.
+	GSC_API int gsc_invoke(gsc_Context *ctx, gsc_ScriptFunction *function, int nargs);
+	GSC_API int gsc_invoke_method(gsc_Context *ctx, gsc_ScriptFunction *function, int nargs); // Self is pushed after the arguments
+
+	typedef void (*gsc_PushArguments)(gsc_Context *ctx, int index, void *userdata);
+	// Start a thread of the function for each object (from gsc_allocate_object or gsc_get_ptr), all at once.
+	// push_arguments is called to push the nargs arguments for objects[index], without it they're undefined.
+	GSC_API int gsc_spawn_threads(gsc_Context *ctx,
+								  gsc_ScriptFunction *function,
+								  void **objects,
+								  int count,
+								  int nargs,
+								  gsc_PushArguments push_arguments,
+								  void *userdata);
 	GSC_API void gsc_object_set_debug_info(gsc_Context *ctx,
 										   void *object,
 										   const char *file,
@@ -103,6 +219,31 @@ extern "C"
 
 	GSC_API void gsc_register_function(gsc_Context *ctx, const char *file, const char *name, gsc_Function);
 
+	// Arguments and return value of a typed function, which member is valid depends on the signature
+	typedef union
+	{
+		int64_t i;
+		float f;
+		float v[3];
+		const char *s;
+		void *o; // Object pointer, same as gsc_get_ptr
+		int b;
+	} gsc_Value;
+
+	typedef void (*gsc_TypedFunction)(gsc_Context *ctx, const gsc_Value *args, gsc_Value *result);
+
+	// Signature is the argument types followed by '>' and the return type, e.g. "vv>f" for (vec3, vec3) -> float
+	// i: integer, f: float (integers are converted), v: vector, s: string, b: boolean, o: object
+	// Leave out the return type or use '-' to return undefined, a NULL string or object is returned as undefined too
+	// The arguments are checked and unpacked by the VM before the call and the result is pushed for you
+	GSC_API int gsc_register_typed_function(gsc_Context *ctx, const char *name, const char *signature, gsc_TypedFunction);
+
+	// Lets gsc_link compile calls of a builtin to the VM's own version of it instead of a function call
+	// Available for isdefined, int, float, length, lengthsquared, distance, distancesquared, vectordot and vectornormalize
+	// Only register the ones that behave the same as your functions, script functions with the name still take precedence
+	// Returns GSC_NOT_FOUND if the VM has no intrinsic with that name
+	GSC_API int gsc_register_intrinsic(gsc_Context *ctx, const char *name);
+
 	GSC_API void gsc_object_set_field(gsc_Context *ctx, int obj_index, const char *name);
 	GSC_API void gsc_object_get_field(gsc_Context *ctx, int obj_index, const char *name);
 	GSC_API const char *gsc_object_get_tag(gsc_Context *ctx, int obj_index);
@@ -124,6 +265,98 @@ extern "C"
 	GSC_API void *gsc_object_get_userdata(gsc_Context *ctx, int obj_index);
 	GSC_API void gsc_object_set_userdata(gsc_Context *ctx, int obj_index, void *userdata);
 
+	// Field of the userdata struct of objects using the proxy, scripts read and write the struct directly
+	// type is GSC_TYPE_INTEGER or GSC_TYPE_BOOLEAN for int, GSC_TYPE_FLOAT for float, GSC_TYPE_VECTOR for float[3]
+	// or GSC_TYPE_STRING for const char * which is always read only
+	#define GSC_FIELD_READ_ONLY (1)
+	typedef struct
+	{
+		const char *name;
+		int type;
+		size_t offset; // offsetof the field in the userdata struct
+		int flags;
+	} gsc_NativeField;
+	// Native fields are looked up before __get and __set, objects without userdata never use them
+	GSC_API void gsc_object_bind_fields(gsc_Context *ctx, int proxy_index, const gsc_NativeField *fields, int count);
+	GSC_API void gsc_object_kill_threads(gsc_Context *ctx, int obj_index); // Kill all threads running with the object as self
+	// Notify event on the object after delay and then every period if it's not 0, notifying endon on the object cancels it
+	GSC_API int64_t gsc_object_notify_after(gsc_Context *ctx, int obj_index, const char *event, float delay, float period, const char *endon);
+	GSC_API int gsc_cancel_timer(gsc_Context *ctx, int64_t timer); // Returns 0 if the timer already finished
+
+	// Handles keep an object alive and reachable without going through the stack, they can be stored across frames
+	// 0 is never a valid handle, handles that were released resolve to nothing instead of another object
+	typedef int64_t gsc_Handle;
+	GSC_API gsc_Handle gsc_handle_create(gsc_Context *ctx, int obj_index);
+	GSC_API gsc_Handle gsc_handle_from_object(gsc_Context *ctx, void *object); // From gsc_allocate_object or gsc_get_ptr
+	GSC_API int gsc_handle_retain(gsc_Context *ctx, gsc_Handle handle);
+	GSC_API int gsc_handle_release(gsc_Context *ctx, gsc_Handle handle); // The handle is gone when every retain is released
+	GSC_API void *gsc_handle_object(gsc_Context *ctx, gsc_Handle handle); // NULL if the handle was released
+	GSC_API int gsc_handle_push(gsc_Context *ctx, gsc_Handle handle); // Returns the stack index of the object
+	GSC_API void gsc_handle_get_field(gsc_Context *ctx, gsc_Handle handle, const char *name); // Pushes the value
+	GSC_API void gsc_handle_set_field(gsc_Context *ctx, gsc_Handle handle, const char *name); // Pops the value
+	// Arguments are pushed in order before these calls
+	GSC_API void gsc_handle_notify(gsc_Context *ctx, gsc_Handle handle, const char *event, int nargs);
+	GSC_API int gsc_handle_call_method(gsc_Context *ctx, gsc_Handle handle, const char *file, const char *function, int nargs);
+	GSC_API int gsc_handle_invoke_method(gsc_Context *ctx, gsc_Handle handle, gsc_ScriptFunction *function, int nargs);
+
+	// Field and event names looked up once, the same name always gives the same key for the lifetime of the context
+	typedef int gsc_Key;
+	GSC_API gsc_Key gsc_key(gsc_Context *ctx, const char *name);
+	GSC_API void gsc_object_get_field_key(gsc_Context *ctx, int obj_index, gsc_Key key);
+	GSC_API void gsc_object_set_field_key(gsc_Context *ctx, int obj_index, gsc_Key key);
+	GSC_API void gsc_handle_get_field_key(gsc_Context *ctx, gsc_Handle handle, gsc_Key key);
+	GSC_API void gsc_handle_set_field_key(gsc_Context *ctx, gsc_Handle handle, gsc_Key key);
+	GSC_API void gsc_handle_notify_key(gsc_Context *ctx, gsc_Handle handle, gsc_Key event, int nargs);
+	// Notifies every handle with events[i], or with events[0] if event_count is 1, the nargs pushed arguments are shared
+	// Released handles are skipped, returns how many objects were notified or -GSC_ERROR if event_count is neither 1 nor count
+	GSC_API int gsc_handle_notify_batch(gsc_Context *ctx, const gsc_Handle *handles, int count, const gsc_Key *events, int event_count, int nargs);
+
+	// Commands can be posted from any OS thread, they're run in the order they were posted at the start of the next update
+	// Handles, keys and functions have to be created beforehand on the thread that updates the context
+	// Returns GSC_YIELD when the queue is full so the caller can try again later, GSC_ERROR for bad arguments
+	#define GSC_COMMAND_MAX_ARGUMENTS (4)
+	#define GSC_COMMAND_MAX_STRING (64) // Bytes for the string arguments of one command together, terminators included
+
+	typedef struct
+	{
+		int type; // GSC_TYPE_UNDEFINED, GSC_TYPE_INTEGER, GSC_TYPE_BOOLEAN, GSC_TYPE_FLOAT, GSC_TYPE_VECTOR or GSC_TYPE_STRING
+		gsc_Value value; // Strings are copied into the command
+	} gsc_CommandArgument;
+
+	typedef struct
+	{
+		int capacity;
+		int pending;
+		int64_t posted;
+		int64_t rejected; // Posts that found the queue full
+		int64_t executed;
+		int64_t dropped; // Commands for handles that were released before they ran
+		int64_t high_water; // Most commands that were pending at the start of an update
+	} gsc_CommandQueueStats;
+
+	GSC_API int gsc_post_notify(gsc_Context *ctx, gsc_Handle handle, gsc_Key event, const gsc_CommandArgument *args, int nargs);
+	GSC_API int gsc_post_set_field(gsc_Context *ctx, gsc_Handle handle, gsc_Key key, const gsc_CommandArgument *value);
+	// Starts a thread of the function with the object of the handle as self
+	GSC_API int gsc_post_call(gsc_Context *ctx, gsc_Handle handle, gsc_ScriptFunction *function, const gsc_CommandArgument *args, int nargs);
+	GSC_API void gsc_command_queue_stats(gsc_Context *ctx, gsc_CommandQueueStats *stats); // Only from the thread that updates
+
+	// A native function starts work with gsc_async_begin and returns GSC_PENDING, the calling script thread then sleeps
+	// until the token is completed and continues with the result as the return value of the call
+	// Completing goes through the command queue so it's safe from any thread, the thread runs the frame after it's drained
+	// Tokens of threads that were killed in the meantime are dropped
+	#define GSC_PENDING (-1)
+	typedef int64_t gsc_Token;
+	GSC_API gsc_Token gsc_async_begin(gsc_Context *ctx);
+	GSC_API int gsc_async_complete(gsc_Context *ctx, gsc_Token token, const gsc_CommandArgument *result); // NULL for undefined
+
+	// Copy one field of many objects (from gsc_allocate_object, gsc_get_ptr or gsc_handle_object) to or from a C array
+	// type is GSC_TYPE_INTEGER or GSC_TYPE_BOOLEAN for int, GSC_TYPE_FLOAT for float or GSC_TYPE_VECTOR for float[3]
+	// stride is the distance in bytes between elements, so it can point into an array of structs
+	// Only stored fields are used, __get and __set of proxies aren't called
+	GSC_API int gsc_scatter_field(gsc_Context *ctx, void **objects, int count, gsc_Key key, int type, const void *data, size_t stride);
+	// Objects without the field or with a non-matching type are skipped, written (optional) gets how many elements were written
+	GSC_API int gsc_gather_field(gsc_Context *ctx, void **objects, int count, gsc_Key key, int type, void *data, size_t stride, int *written);
+
 	GSC_API void gsc_add_int(gsc_Context *ctx, int64_t value);			  // Push an integer
 	GSC_API void gsc_add_float(gsc_Context *ctx, float value);		  // Push a float
 	GSC_API void gsc_add_string(gsc_Context *ctx, const char *value); // Push a string
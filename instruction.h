@@ -28,7 +28,12 @@
 	X(UNARY)       \
 	X(VECTOR)      \
 	X(PRINT_EXPR)      \
-	X(GLOBAL)
+	X(GLOBAL)      \
+	X(INTRINSIC)   \
+	X(INTRINSIC_CALL) \
+	X(NOTIFY)      \
+	X(WAITTILL)    \
+	X(ENDON)
  // X(SELF)
 
 typedef enum
@@ -44,6 +49,35 @@ static const char *opcode_names[] = {
 	OPCODES(OPCODE_ENUM_STR) NULL,
 };
 
+// Pure builtins, calls by name with the right number of arguments compile to OP_INTRINSIC_CALL
+// gsc_link turns those into OP_INTRINSIC when the host registered the intrinsic and no script function has the name
+// NAME, script name, argument count
+#define INTRINSICS(X)                             \
+	X(ISDEFINED, "isdefined", 1)                  \
+	X(INT, "int", 1)                              \
+	X(FLOAT, "float", 1)                          \
+	X(LENGTH, "length", 1)                        \
+	X(LENGTHSQUARED, "lengthsquared", 1)          \
+	X(DISTANCE, "distance", 2)                    \
+	X(DISTANCESQUARED, "distancesquared", 2)      \
+	X(VECTORDOT, "vectordot", 2)                  \
+	X(VECTORNORMALIZE, "vectornormalize", 1)
+
+typedef enum
+{
+#define INTRINSIC_ENUM(NAME, STR, ARGC) INTRINSIC_##NAME,
+	INTRINSICS(INTRINSIC_ENUM) INTRINSIC_MAX
+} Intrinsic;
+
+static const struct
+{
+	const char *name;
+	int argc;
+} intrinsics[] = {
+#define INTRINSIC_ENTRY(NAME, STR, ARGC) { STR, ARGC },
+	INTRINSICS(INTRINSIC_ENTRY) { NULL, 0 },
+};
+
 #define VM_CALL_FLAG_NONE (0)
 #define VM_CALL_FLAG_THREADED (1)
 #define VM_CALL_FLAG_METHOD (2)
@@ -9,7 +9,9 @@ extern "C"
 #include "ast.h"
 #include "compiler.h"
 #include "library.h"
+#include "virtual_memory.h"
 #include <setjmp.h>
+#include <inttypes.h>
 
 #define SMALL_STACK_SIZE (16)
 
@@ -79,6 +81,26 @@ static int error(gsc_Context *state, const char *fmt, ...)
 		return GSC_ERROR;  \
 	}
 
+enum
+{
+	COMMAND_NOTIFY,
+	COMMAND_SET_FIELD,
+	COMMAND_CALL,
+	COMMAND_COMPLETE // handle is the token
+};
+
+// Posted by gsc_post_* from any thread, run by run_commands on the thread that updates
+typedef struct
+{
+	int kind;
+	gsc_Key key; // Event or field
+	gsc_Handle handle;
+	gsc_ScriptFunction *function;
+	int nargs;
+	gsc_CommandArgument arguments[GSC_COMMAND_MAX_ARGUMENTS];
+	char strings[GSC_COMMAND_MAX_STRING];
+} Command;
+
 static void *gsc_malloc(void *ctx, size_t size)
 {
 	gsc_Context *state = (gsc_Context*)ctx;
@@ -92,6 +114,85 @@ static void gsc_free(void *ctx, void *ptr)
 	// state->options.free_memory(state->options.userdata, ptr);
 }
 
+static void *host_malloc(void *ctx, size_t size)
+{
+	gsc_Context *state = (gsc_Context *)ctx;
+	return state->options.allocate_memory(state->options.userdata, (int)size);
+}
+
+static void host_free(void *ctx, void *ptr)
+{
+	gsc_Context *state = (gsc_Context *)ctx;
+	state->options.free_memory(state->options.userdata, ptr);
+}
+
+static bool reserve_virtual_arena(gsc_Context *ctx, Arena *arena, ArenaInfo *info, const char *name, size_t size)
+{
+	size_t step = ctx->options.memory_chunk_size > 0 ? ctx->options.memory_chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+	size = (size + step - 1) / step * step;
+	char *reserved = virtual_memory_reserve(size);
+	if(!reserved)
+		return false;
+	arena_init_virtual(arena, info, name, reserved, size, step, virtual_memory_commit);
+	return true;
+}
+
+static void release_arena(gsc_Context *ctx, ArenaInfo *info)
+{
+	if(info->commit)
+		virtual_memory_release(info->base, info->reserve_end - info->base);
+	else
+		arena_release(info);
+}
+
+static void init_arenas(gsc_Context *ctx, Arena *strtab_arena)
+{
+	gsc_CreateOptions *options = &ctx->options;
+	size_t chunk_size = options->memory_chunk_size > 0 ? options->memory_chunk_size : ARENA_DEFAULT_CHUNK_SIZE;
+	if(options->memory_mode == GSC_MEMORY_VIRTUAL)
+	{
+		if(reserve_virtual_arena(ctx, &ctx->perm, &ctx->perm_info, "perm", options->main_memory_size))
+		{
+			if(reserve_virtual_arena(ctx, &ctx->temp, &ctx->temp_info, "temp", options->temp_memory_size))
+			{
+				if(reserve_virtual_arena(ctx, strtab_arena, &ctx->strtab_info, "strtab", options->string_table_memory_size))
+					return;
+				release_arena(ctx, &ctx->temp_info);
+			}
+			release_arena(ctx, &ctx->perm_info);
+		}
+		// No virtual memory available, fall back to chaining chunks
+		options->memory_mode = GSC_MEMORY_CHAINED;
+	}
+	if(options->memory_mode == GSC_MEMORY_CHAINED)
+	{
+		arena_init_chained(&ctx->perm, &ctx->perm_info, "perm", &ctx->host_allocator, chunk_size, options->main_memory_size);
+		arena_init_chained(&ctx->temp, &ctx->temp_info, "temp", &ctx->host_allocator, chunk_size, options->temp_memory_size);
+		arena_init_chained(strtab_arena, &ctx->strtab_info, "strtab", &ctx->host_allocator, chunk_size, options->string_table_memory_size);
+		return;
+	}
+	// TODO: FIXME
+	// #define HEAP_SIZE (512 * 1024 * 1024)
+	// #define HEAP_SIZE (28 * 1024 * 1024)
+	// #define HEAP_SIZE (85 * 1024 * 1024)
+	// #define HEAP_SIZE (83 * 1024 * 1024)
+	ctx->heap = options->allocate_memory(options->userdata, options->main_memory_size);
+	if(!ctx->heap)
+		longjmp(ctx->jmp_oom, 1);
+	arena_init_fixed(&ctx->perm, &ctx->perm_info, "perm", ctx->heap, options->main_memory_size);
+	ctx->perm.jmp_oom = &ctx->jmp_oom;
+
+	// #define TEMP_SIZE (20 * 1024 * 1024)
+	arena_init_fixed(&ctx->temp, &ctx->temp_info, "temp", new(&ctx->perm, char, options->temp_memory_size), options->temp_memory_size);
+
+	// #define STRTAB_SIZE (1 * 1024 * 1024)
+	arena_init_fixed(strtab_arena,
+					 &ctx->strtab_info,
+					 "strtab",
+					 new(&ctx->perm, char, options->string_table_memory_size),
+					 options->string_table_memory_size);
+}
+
 static CompiledFile *get_file(gsc_Context *state, const char *file)
 {
 	HashTrieNode *n = hash_trie_upsert(&state->files, file, NULL, false);
@@ -127,13 +228,35 @@ static int f_endon(gsc_Context *ctx)
 	const char *key = vm_checkstring(vm, 0);
 	Thread *thr = vm_thread(vm);
 	int idx = vm_string_index(vm, key);
-	if(thr->endon_string_count >= VM_MAX_ENDON_STRINGS)
-		vm_error(ctx->vm, "Max endon string count (%d) reached", VM_MAX_ENDON_STRINGS);
-	thr->endon[thr->endon_string_count++] = idx;
+	vm_subscribe(vm, thr, self, idx, VM_SUBSCRIPTION_ENDON);
 	// buf_push(thr->endon, idx);
 	return 0;
 }
 
+static int f_setthreadpriority(gsc_Context *ctx)
+{
+	VM *vm = ctx->vm;
+	int priority;
+	if(gsc_get_type(ctx, 0) == GSC_TYPE_STRING || gsc_get_type(ctx, 0) == GSC_TYPE_INTERNED_STRING)
+	{
+		static const char *names[] = { "high", "normal", "low" };
+		const char *name = gsc_get_string(ctx, 0);
+		for(priority = 0; priority < GSC_PRIORITY_MAX; ++priority)
+		{
+			if(!stricmp(names[priority], name))
+				break;
+		}
+		if(priority == GSC_PRIORITY_MAX)
+			vm_error(vm, "Unknown thread priority '%s'", name);
+	}
+	else
+	{
+		priority = gsc_get_int(ctx, 0);
+	}
+	vm_set_thread_priority(vm, vm_thread(vm), priority);
+	return 0;
+}
+
 // TODO: wait for animation event / notetracks
 // Hack: prefix with anim_ and notify when animation is done / encounters a notetrack
 
@@ -144,26 +267,12 @@ static int f_waittillmatch(gsc_Context *ctx)
 	const char *key = vm_checkstring(vm, 0);
 	char fake_key[256];
 	snprintf(fake_key, sizeof(fake_key), "$nt_%s", key);
-	Thread *thr = vm_thread(vm);
-	thr->state = VM_THREAD_WAITING_EVENT;
-
-	for(int i = 1; i < vm_argc(vm); i++)
-	{
-		Variable arg = *vm_argv(vm, i);
-		if(arg.type != VAR_REFERENCE)
-		{
-			vm_error(vm, "Expected reference for waittillmatch");
-		}
-		thr->waittill.arguments[i - 1] = arg;
-	}
-	thr->waittill.numargs = vm_argc(vm) - 1;
-
-	thr->waittill.name = vm_string_index(vm, fake_key);
-	thr->waittill.object = self;
-	if(thr->waittill.name == -1)
+	int name = vm_string_index(vm, fake_key);
+	if(name == -1)
 	{
 		vm_error(vm, "Key '%s' not found", fake_key);
 	}
+	vm_waittill(vm, vm_thread(vm), self, name, vm_argv(vm, 1), vm_argc(vm) - 1);
 	return 0;
 }
 
@@ -172,29 +281,90 @@ static int f_waittill(gsc_Context *ctx)
 	VM *vm = ctx->vm;
 	Object *self = vm_cast_object(ctx->vm, vm_argv(ctx->vm, -1));
 	const char *key = vm_checkstring(vm, 0);
-	Thread *thr = vm_thread(vm);
-	thr->state = VM_THREAD_WAITING_EVENT;
-	// thr->waittill.arguments = NULL;
-	for(int i = 1; i < vm_argc(vm); i++)
+	int name = vm_string_index(vm, key);
+	if(name == -1)
 	{
-		Variable arg = *vm_argv(vm, i);
-		if(arg.type != VAR_REFERENCE)
-		{
-			vm_error(vm, "Expected reference for waittill");
-		}
-		thr->waittill.arguments[i - 1] = arg;
+		vm_error(vm, "Key '%s' not found", key);
 	}
-	thr->waittill.numargs = vm_argc(vm) - 1;
-	thr->waittill.name = vm_string_index(vm, key);
-	thr->waittill.object = self;
-	if(thr->waittill.name == -1)
+	vm_waittill(vm, vm_thread(vm), self, name, vm_argv(vm, 1), vm_argc(vm) - 1);
+	return 0;
+}
+
+// self waittill_any(event, ...), returns the event that came in
+static int f_waittill_any(gsc_Context *ctx)
+{
+	VM *vm = ctx->vm;
+	Object *self = vm_cast_object(ctx->vm, vm_argv(ctx->vm, -1));
+	Thread *thr = vm_thread(vm);
+	// Nothing could wake the thread up
+	if(vm_argc(vm) == 0)
+		vm_error(vm, "Expected at least one event for waittill_any");
+	for(int i = 0; i < vm_argc(vm); i++)
+		vm_subscribe(vm, thr, self, vm_string_index(vm, vm_checkstring(vm, i)), VM_SUBSCRIPTION_WAITTILL);
+	vm_wait_any(vm, thr, -1.f);
+	return 0;
+}
+
+// self waittill_any_timeout(timeout, event, ...), returns the event that came in or "timeout"
+static int f_waittill_any_timeout(gsc_Context *ctx)
+{
+	VM *vm = ctx->vm;
+	Object *self = vm_cast_object(ctx->vm, vm_argv(ctx->vm, -1));
+	Thread *thr = vm_thread(vm);
+	float timeout = gsc_get_float(ctx, 0);
+	for(int i = 1; i < vm_argc(vm); i++)
+		vm_subscribe(vm, thr, self, vm_string_index(vm, vm_checkstring(vm, i)), VM_SUBSCRIPTION_WAITTILL);
+	vm_wait_any(vm, thr, timeout < 0.f ? 0.f : timeout);
+	return 0;
+}
+
+// waittill_any_ents(object, event, object, event, ...), returns the event that came in
+static int f_waittill_any_ents(gsc_Context *ctx)
+{
+	VM *vm = ctx->vm;
+	Thread *thr = vm_thread(vm);
+	if(vm_argc(vm) == 0 || vm_argc(vm) % 2 != 0)
+		vm_error(vm, "Expected pairs of objects and events for waittill_any_ents");
+	for(int i = 0; i < vm_argc(vm); i += 2)
 	{
-		vm_error(vm, "Key '%s' not found", key);
+		Object *object = vm_cast_object(vm, vm_argv(vm, i));
+		vm_subscribe(vm, thr, object, vm_string_index(vm, vm_checkstring(vm, i + 1)), VM_SUBSCRIPTION_WAITTILL);
 	}
-	// printf("[VM] TODO implement waittill: %s\n", key);
+	vm_wait_any(vm, thr, -1.f);
 	return 0;
 }
 
+static int add_timer(gsc_Context *ctx, float delay, float period)
+{
+	VM *vm = ctx->vm;
+	Object *self = vm_cast_object(ctx->vm, vm_argv(ctx->vm, -1));
+	int name = vm_string_index(vm, vm_checkstring(vm, 1));
+	int endon = vm_argc(vm) > 2 ? vm_string_index(vm, vm_checkstring(vm, 2)) : -1;
+	gsc_add_int(ctx, vm_add_timer(vm, self, name, delay, period, endon));
+	return 1;
+}
+
+// self notifyafter(delay, event, [endon]), returns a timer to cancel
+static int f_notifyafter(gsc_Context *ctx)
+{
+	return add_timer(ctx, gsc_get_float(ctx, 0), 0.f);
+}
+
+// self notifyevery(period, event, [endon]), returns a timer to cancel
+static int f_notifyevery(gsc_Context *ctx)
+{
+	float period = gsc_get_float(ctx, 0);
+	if(period <= 0.f)
+		vm_error(ctx->vm, "Period of notifyevery must be positive");
+	return add_timer(ctx, period, period);
+}
+
+static int f_canceltimer(gsc_Context *ctx)
+{
+	gsc_add_bool(ctx, vm_cancel_timer(ctx->vm, gsc_get_int(ctx, 0)));
+	return 1;
+}
+
 static int f_notify(gsc_Context *ctx)
 {
 	VM *vm = ctx->vm;
@@ -237,6 +407,15 @@ GSC_API void gsc_object_set_proxy(gsc_Context *ctx, int obj_index, int proxy_ind
 	o->proxy = pv->u.oval;
 }
 
+GSC_API void gsc_object_bind_fields(gsc_Context *ctx, int proxy_index, const gsc_NativeField *fields, int count)
+{
+	Variable *pv = vm_stack(ctx->vm, proxy_index);
+	if(pv->type != VAR_OBJECT)
+		vm_error(ctx->vm, "'%s' is not a object", variable_type_names[pv->type]);
+	for(int i = 0; i < count; ++i)
+		vm_bind_native_field(ctx->vm, pv->u.oval, fields[i].name, fields[i].type, fields[i].offset, fields[i].flags);
+}
+
 GSC_API int gsc_object_get_proxy(gsc_Context *ctx, int obj_index)
 {
 	Variable *ov = vm_stack(ctx->vm, obj_index);
@@ -290,6 +469,14 @@ static void create_default_object_proxy(gsc_Context *ctx)
 		gsc_object_set_field(ctx, methods, "notify");
 		gsc_add_function(ctx, f_waittillmatch);
 		gsc_object_set_field(ctx, methods, "waittillmatch");
+		gsc_add_function(ctx, f_waittill_any);
+		gsc_object_set_field(ctx, methods, "waittill_any");
+		gsc_add_function(ctx, f_waittill_any_timeout);
+		gsc_object_set_field(ctx, methods, "waittill_any_timeout");
+		gsc_add_function(ctx, f_notifyafter);
+		gsc_object_set_field(ctx, methods, "notifyafter");
+		gsc_add_function(ctx, f_notifyevery);
+		gsc_object_set_field(ctx, methods, "notifyevery");
 	gsc_object_set_field(ctx, proxy, "__call");
 
 	gsc_set_global(ctx, "object");
@@ -298,12 +485,16 @@ static void create_default_object_proxy(gsc_Context *ctx)
 GSC_API gsc_Context *gsc_create(gsc_CreateOptions options)
 {
 	gsc_Context *ctx = options.allocate_memory(options.userdata, sizeof(gsc_Context));
+	if(!ctx)
+		return NULL;
 	memset(ctx, 0, sizeof(gsc_Context));
 	ctx->options = options;
 
 	if(setjmp(ctx->jmp_oom))
 	{
 		// printf("Out of memory\n");
+		// Whatever was set up so far is zeroed or valid, gsc_destroy can tear it down
+		gsc_destroy(ctx);
 		return NULL;
 	}
 
@@ -311,26 +502,17 @@ GSC_API gsc_Context *gsc_create(gsc_CreateOptions options)
 	ctx->allocator.malloc = gsc_malloc;
 	ctx->allocator.free = gsc_free;
 
-	hash_trie_init(&ctx->files);
+	ctx->host_allocator.ctx = ctx;
+	ctx->host_allocator.malloc = host_malloc;
+	ctx->host_allocator.free = host_free;
 
-	// TODO: FIXME
-	// #define HEAP_SIZE (512 * 1024 * 1024)
-	// #define HEAP_SIZE (28 * 1024 * 1024)
-	// #define HEAP_SIZE (85 * 1024 * 1024)
-	// #define HEAP_SIZE (83 * 1024 * 1024)
-	ctx->heap = options.allocate_memory(options.userdata, options.main_memory_size);
-	arena_init(&ctx->perm, ctx->heap, options.main_memory_size);
-	ctx->perm.jmp_oom = &ctx->jmp_oom;
-	
-	// #define TEMP_SIZE (20 * 1024 * 1024)
-
-	arena_init(&ctx->temp, new(&ctx->perm, char, options.temp_memory_size), options.temp_memory_size);
-	ctx->temp.jmp_oom = ctx->perm.jmp_oom;
+	hash_trie_init(&ctx->files);
 
-	// #define STRTAB_SIZE (1 * 1024 * 1024)
 	Arena strtab_arena;
-	arena_init(&strtab_arena, new(&ctx->perm, char, options.string_table_memory_size), options.string_table_memory_size);
-	strtab_arena.jmp_oom = ctx->perm.jmp_oom;
+	init_arenas(ctx, &strtab_arena);
+	ctx->perm.jmp_oom = &ctx->jmp_oom;
+	ctx->temp.jmp_oom = &ctx->jmp_oom;
+	strtab_arena.jmp_oom = &ctx->jmp_oom;
 
 	string_table_init(&ctx->strtab, strtab_arena);
 
@@ -344,7 +526,12 @@ GSC_API gsc_Context *gsc_create(gsc_CreateOptions options)
 	vm->func_lookup = vm_func_lookup;
 
 	ctx->vm = vm;
+	if(options.command_queue_size > 0 && !command_queue_init(&ctx->commands, &ctx->host_allocator, options.command_queue_size, sizeof(Command)))
+		longjmp(ctx->jmp_oom, 1);
 	create_default_object_proxy(ctx);
+	gsc_register_function(ctx, NULL, "setthreadpriority", f_setthreadpriority);
+	gsc_register_function(ctx, NULL, "waittill_any_ents", f_waittill_any_ents);
+	gsc_register_function(ctx, NULL, "canceltimer", f_canceltimer);
 	return ctx;
 }
 
@@ -352,20 +539,100 @@ GSC_API void gsc_destroy(gsc_Context *state)
 {
 	if(state)
 	{
-		vm_cleanup(state->vm);
+		if(state->vm)
+			vm_cleanup(state->vm);
+		command_queue_destroy(&state->commands);
 
 		gsc_CreateOptions opts = state->options;
-		opts.free_memory(opts.userdata, state->heap);
+		release_arena(state, &state->strtab_info);
+		release_arena(state, &state->temp_info);
+		release_arena(state, &state->perm_info);
+		if(state->heap)
+			opts.free_memory(opts.userdata, state->heap);
 		// opts.free_memory(opts.userdata, state->vm);
 		opts.free_memory(opts.userdata, state);
 	}
 }
 
+GSC_API void gsc_memory_stats(gsc_Context *ctx, gsc_MemoryStats *stats)
+{
+	memset(stats, 0, sizeof(gsc_MemoryStats));
+	Slab *slab = &ctx->vm->slab;
+	for(int i = 0; i < slab->class_count && i < GSC_MAX_SLAB_CLASSES; ++i)
+	{
+		SlabClass *cls = &slab->classes[i];
+		gsc_SlabStats *out = &stats->slabs[stats->slab_count++];
+		out->name = cls->name;
+		out->slot_size = cls->slot_size;
+		out->chunk_count = cls->chunk_count;
+		out->reserved_bytes = cls->reserved_bytes;
+		out->live = cls->live;
+		out->peak = cls->peak;
+		out->allocations = cls->allocations;
+	}
+	struct
+	{
+		Arena *arena;
+		ArenaInfo *info;
+	} arenas[] = { { &ctx->perm, &ctx->perm_info },
+				   { &ctx->temp, &ctx->temp_info },
+				   { &ctx->strtab.arena, &ctx->strtab_info },
+				   { &ctx->vm->c_function_arena, &ctx->vm->c_function_arena_info } };
+	for(int i = 0; i < sizeof(arenas) / sizeof(arenas[0]) && i < GSC_MAX_ARENAS; ++i)
+	{
+		ArenaInfo *info = arenas[i].info;
+		gsc_ArenaStats *out = &stats->arenas[stats->arena_count++];
+		out->name = info->name;
+		out->chunk_count = info->chunk_count;
+		out->reserved_bytes = info->reserved;
+		out->used_bytes = arena_used(arenas[i].arena);
+		out->peak_bytes = info->peak;
+	}
+}
+
+GSC_API void gsc_scheduler_stats(gsc_Context *ctx, gsc_SchedulerStats *stats)
+{
+	VM *vm = ctx->vm;
+	for(int i = 0; i < GSC_PRIORITY_MAX; ++i)
+	{
+		stats->classes[i] = vm->priority_stats[i];
+		stats->classes[i].threads = 0;
+	}
+	for(Thread *t = vm->threads; t; t = t->next)
+	{
+		if(t->state != VM_THREAD_INACTIVE)
+			stats->classes[t->priority].threads++;
+	}
+	stats->threads_spawned = vm->threads_spawned;
+	stats->batch_spawned = vm->batch_spawned;
+	stats->batch_spawn_ms = vm->batch_spawn_ms;
+}
+
+GSC_API void gsc_set_thread_priority(gsc_Context *ctx, int priority)
+{
+	VM *vm = ctx->vm;
+	if(vm->thread == &vm->temp_thread)
+	{
+		if(priority < GSC_PRIORITY_HIGH || priority >= GSC_PRIORITY_MAX)
+			vm_error(vm, "Invalid thread priority %d", priority);
+		vm->call_priority = priority;
+		return;
+	}
+	vm_set_thread_priority(vm, vm->thread, priority);
+}
+
 GSC_API void gsc_register_function(gsc_Context *state, const char *namespace, const char *name, gsc_Function callback)
 {
 	vm_register_callback_function(state->vm, name, (void*)callback, state);
 }
 
+GSC_API int gsc_register_typed_function(gsc_Context *ctx, const char *name, const char *signature, gsc_TypedFunction callback)
+{
+	if(!vm_register_typed_function(ctx->vm, name, signature, callback, ctx))
+		return GSC_ERROR;
+	return GSC_OK;
+}
+
 GSC_API void *gsc_object_get_userdata(gsc_Context *ctx, int obj_index)
 {
 	Variable *ov = vm_stack(ctx->vm, obj_index);
@@ -375,6 +642,369 @@ GSC_API void *gsc_object_get_userdata(gsc_Context *ctx, int obj_index)
 	return o->userdata;
 }
 
+GSC_API void gsc_object_kill_threads(gsc_Context *ctx, int obj_index)
+{
+	Variable *ov = vm_stack(ctx->vm, obj_index);
+	if(ov->type != VAR_OBJECT)
+		vm_error(ctx->vm, "'%s' is not a object", variable_type_names[ov->type]);
+	vm_kill_object_threads(ctx->vm, ov->u.oval);
+}
+
+GSC_API int64_t gsc_object_notify_after(gsc_Context *ctx, int obj_index, const char *event, float delay, float period, const char *endon)
+{
+	Variable *ov = vm_stack(ctx->vm, obj_index);
+	if(ov->type != VAR_OBJECT)
+		vm_error(ctx->vm, "'%s' is not a object", variable_type_names[ov->type]);
+	VM *vm = ctx->vm;
+	return vm_add_timer(vm, ov->u.oval, vm_string_index(vm, event), delay, period, endon ? vm_string_index(vm, endon) : -1);
+}
+
+GSC_API int gsc_cancel_timer(gsc_Context *ctx, int64_t timer)
+{
+	return vm_cancel_timer(ctx->vm, timer);
+}
+
+GSC_API gsc_Handle gsc_handle_create(gsc_Context *ctx, int obj_index)
+{
+	Variable *ov = vm_stack(ctx->vm, obj_index);
+	if(ov->type != VAR_OBJECT)
+		vm_error(ctx->vm, "'%s' is not a object", variable_type_names[ov->type]);
+	return vm_create_handle(ctx->vm, ov->u.oval);
+}
+
+GSC_API gsc_Handle gsc_handle_from_object(gsc_Context *ctx, void *object)
+{
+	return vm_create_handle(ctx->vm, (Object *)object);
+}
+
+GSC_API int gsc_handle_retain(gsc_Context *ctx, gsc_Handle handle)
+{
+	return vm_retain_handle(ctx->vm, handle) ? GSC_OK : GSC_ERROR;
+}
+
+GSC_API int gsc_handle_release(gsc_Context *ctx, gsc_Handle handle)
+{
+	return vm_release_handle(ctx->vm, handle) ? GSC_OK : GSC_ERROR;
+}
+
+GSC_API void *gsc_handle_object(gsc_Context *ctx, gsc_Handle handle)
+{
+	return vm_handle_object(ctx->vm, handle);
+}
+
+static Variable handle_variable(gsc_Context *ctx, gsc_Handle handle)
+{
+	Object *o = vm_handle_object(ctx->vm, handle);
+	if(!o)
+		vm_error(ctx->vm, "Invalid handle %" PRId64, handle);
+	Variable v = { .type = VAR_OBJECT };
+	v.u.oval = o;
+	return v;
+}
+
+GSC_API int gsc_handle_push(gsc_Context *ctx, gsc_Handle handle)
+{
+	Variable v = handle_variable(ctx, handle);
+	return vm_pushobject(ctx->vm, v.u.oval);
+}
+
+GSC_API void gsc_handle_get_field(gsc_Context *ctx, gsc_Handle handle, const char *name)
+{
+	void get_object_field(VM *vm, Variable *ov, const char *key);
+	Variable v = handle_variable(ctx, handle);
+	get_object_field(ctx->vm, &v, name);
+}
+
+GSC_API void gsc_handle_set_field(gsc_Context *ctx, gsc_Handle handle, const char *name)
+{
+	void set_object_field(VM *vm, Variable *ov, const char *key);
+	Variable v = handle_variable(ctx, handle);
+	set_object_field(ctx->vm, &v, name);
+}
+
+// The event wants the first argument on top, like a call from script, returns where vm_notify_event starts reading
+static Variable *event_arguments(VM *vm, Variable *args, int nargs)
+{
+	if(nargs > VM_MAX_EVENT_ARGS)
+		vm_error(vm, "Too many arguments for notify");
+	for(int i = 0; i < nargs; ++i)
+		args[nargs - 1 - i] = *vm_stack_top(vm, i - nargs);
+	return nargs > 0 ? &args[nargs - 1] : args;
+}
+
+static void handle_notify(gsc_Context *ctx, gsc_Handle handle, int event, int nargs)
+{
+	Variable v = handle_variable(ctx, handle);
+	Variable args[VM_MAX_EVENT_ARGS];
+	vm_notify_event(ctx->vm, v.u.oval, event, event_arguments(ctx->vm, args, nargs), nargs);
+	gsc_pop(ctx, nargs);
+}
+
+GSC_API void gsc_handle_notify(gsc_Context *ctx, gsc_Handle handle, const char *event, int nargs)
+{
+	handle_notify(ctx, handle, vm_string_index(ctx->vm, event), nargs);
+}
+
+GSC_API void gsc_handle_notify_key(gsc_Context *ctx, gsc_Handle handle, gsc_Key event, int nargs)
+{
+	handle_notify(ctx, handle, vm_key_string_index(ctx->vm, event), nargs);
+}
+
+GSC_API int gsc_handle_notify_batch(gsc_Context *ctx, const gsc_Handle *handles, int count, const gsc_Key *events, int event_count, int nargs)
+{
+	VM *vm = ctx->vm;
+	// Negative so it can't be mistaken for a count
+	if(event_count != 1 && event_count != count)
+	{
+		gsc_pop(ctx, nargs);
+		return -GSC_ERROR;
+	}
+	Variable args[VM_MAX_EVENT_ARGS];
+	Variable *first = event_arguments(vm, args, nargs);
+	int notified = 0;
+	if(count <= 0)
+	{
+		gsc_pop(ctx, nargs);
+		return notified;
+	}
+	vm_reserve_events(vm, count);
+	int event = vm_key_string_index(vm, events[0]);
+	for(int i = 0; i < count; ++i)
+	{
+		Object *o = vm_handle_object(vm, handles[i]);
+		if(!o)
+			continue;
+		if(event_count > 1)
+			event = vm_key_string_index(vm, events[i]);
+		vm_notify_event(vm, o, event, first, nargs);
+		notified++;
+	}
+	gsc_pop(ctx, nargs);
+	return notified;
+}
+
+// Runs on the posting thread, it must not touch the VM
+static int post_command(gsc_Context *ctx, int kind, gsc_Handle handle, gsc_Key key, gsc_ScriptFunction *function, const gsc_CommandArgument *args, int nargs)
+{
+	if(!ctx->commands.cells || nargs < 0 || nargs > GSC_COMMAND_MAX_ARGUMENTS || (nargs > 0 && !args))
+		return GSC_ERROR;
+	// Everything is checked before a cell is claimed, a claimed cell has to be published
+	size_t string_bytes = 0;
+	for(int i = 0; i < nargs; ++i)
+	{
+		switch(args[i].type)
+		{
+			case GSC_TYPE_UNDEFINED:
+			case GSC_TYPE_INTEGER:
+			case GSC_TYPE_BOOLEAN:
+			case GSC_TYPE_FLOAT:
+			case GSC_TYPE_VECTOR: break;
+			case GSC_TYPE_STRING:
+				if(!args[i].value.s)
+					return GSC_ERROR;
+				string_bytes += strlen(args[i].value.s) + 1;
+				break;
+			default: return GSC_ERROR;
+		}
+	}
+	if(string_bytes > GSC_COMMAND_MAX_STRING)
+		return GSC_ERROR;
+	int64_t pos;
+	Command *cmd = command_queue_reserve(&ctx->commands, &pos);
+	if(!cmd)
+		return GSC_YIELD;
+	cmd->kind = kind;
+	cmd->key = key;
+	cmd->handle = handle;
+	cmd->function = function;
+	cmd->nargs = nargs;
+	size_t used = 0;
+	for(int i = 0; i < nargs; ++i)
+	{
+		cmd->arguments[i] = args[i];
+		if(args[i].type == GSC_TYPE_STRING)
+		{
+			size_t n = strlen(args[i].value.s) + 1;
+			memcpy(&cmd->strings[used], args[i].value.s, n);
+			cmd->arguments[i].value.s = &cmd->strings[used];
+			used += n;
+		}
+	}
+	command_queue_commit(&ctx->commands, cmd, pos);
+	return GSC_OK;
+}
+
+GSC_API int gsc_post_notify(gsc_Context *ctx, gsc_Handle handle, gsc_Key event, const gsc_CommandArgument *args, int nargs)
+{
+	return post_command(ctx, COMMAND_NOTIFY, handle, event, NULL, args, nargs);
+}
+
+GSC_API int gsc_post_set_field(gsc_Context *ctx, gsc_Handle handle, gsc_Key key, const gsc_CommandArgument *value)
+{
+	return post_command(ctx, COMMAND_SET_FIELD, handle, key, NULL, value, 1);
+}
+
+GSC_API int gsc_post_call(gsc_Context *ctx, gsc_Handle handle, gsc_ScriptFunction *function, const gsc_CommandArgument *args, int nargs)
+{
+	if(!function)
+		return GSC_ERROR;
+	return post_command(ctx, COMMAND_CALL, handle, 0, function, args, nargs);
+}
+
+GSC_API gsc_Token gsc_async_begin(gsc_Context *ctx)
+{
+	return vm_async_begin(ctx->vm);
+}
+
+GSC_API int gsc_async_complete(gsc_Context *ctx, gsc_Token token, const gsc_CommandArgument *result)
+{
+	return post_command(ctx, COMMAND_COMPLETE, token, 0, NULL, result, result ? 1 : 0);
+}
+
+static void push_command_argument(VM *vm, gsc_CommandArgument *arg)
+{
+	switch(arg->type)
+	{
+		case GSC_TYPE_INTEGER: vm_pushinteger(vm, arg->value.i); break;
+		case GSC_TYPE_BOOLEAN: vm_pushbool(vm, arg->value.b != 0); break;
+		case GSC_TYPE_FLOAT: vm_pushfloat(vm, arg->value.f); break;
+		case GSC_TYPE_VECTOR: vm_pushvector(vm, arg->value.v); break;
+		case GSC_TYPE_STRING: vm_pushstring(vm, arg->value.s); break;
+		default: vm_pushundefined(vm); break;
+	}
+}
+
+static void push_command_arguments(void *ctx, int index, void *userdata)
+{
+	gsc_Context *state = ctx;
+	Command *cmd = userdata;
+	for(int i = 0; i < cmd->nargs; ++i)
+		push_command_argument(state->vm, &cmd->arguments[i]);
+}
+
+static void run_command(gsc_Context *ctx, Command *cmd)
+{
+	VM *vm = ctx->vm;
+	if(cmd->kind == COMMAND_COMPLETE)
+	{
+		Variable result = { .type = VAR_UNDEFINED };
+		if(cmd->nargs > 0)
+		{
+			push_command_argument(vm, &cmd->arguments[0]);
+			result = vm_pop(vm);
+		}
+		if(!vm_async_complete(vm, cmd->handle, &result))
+			ctx->commands_dropped++;
+		return;
+	}
+	Object *o = vm_handle_object(vm, cmd->handle);
+	if(!o)
+	{
+		ctx->commands_dropped++;
+		return;
+	}
+	switch(cmd->kind)
+	{
+		case COMMAND_NOTIFY:
+			push_command_arguments(ctx, 0, cmd);
+			handle_notify(ctx, cmd->handle, vm_key_string_index(vm, cmd->key), cmd->nargs);
+			break;
+		case COMMAND_SET_FIELD:
+		{
+			Variable v = handle_variable(ctx, cmd->handle);
+			push_command_argument(vm, &cmd->arguments[0]);
+			vm_set_field_key(vm, &v, cmd->key);
+		}
+		break;
+		case COMMAND_CALL:
+			vm_spawn_threads(vm, (CompiledFunction *)cmd->function, &o, 1, cmd->nargs, push_command_arguments, cmd);
+			break;
+	}
+}
+
+// Only what was posted before the update started runs, so producers can't keep the update busy
+static void run_commands(gsc_Context *ctx)
+{
+	CommandQueue *q = &ctx->commands;
+	if(!q->cells)
+		return;
+	int64_t pending = command_queue_pending(q);
+	if(pending > q->high_water)
+		q->high_water = pending;
+	for(int64_t i = 0; i < pending; ++i)
+	{
+		Command *cmd = command_queue_peek(q);
+		if(!cmd) // Claimed but still being written
+			break;
+		run_command(ctx, cmd);
+		command_queue_pop(q);
+	}
+}
+
+GSC_API void gsc_command_queue_stats(gsc_Context *ctx, gsc_CommandQueueStats *stats)
+{
+	CommandQueue *q = &ctx->commands;
+	memset(stats, 0, sizeof(gsc_CommandQueueStats));
+	if(!q->cells)
+		return;
+	stats->capacity = (int)command_queue_capacity(q);
+	stats->pending = (int)command_queue_pending(q);
+	stats->posted = atomic_load_acquire(&q->pushed);
+	stats->rejected = atomic_load_acquire(&q->rejected);
+	stats->dropped = ctx->commands_dropped;
+	stats->executed = q->popped - ctx->commands_dropped;
+	stats->high_water = q->high_water;
+}
+
+GSC_API gsc_Key gsc_key(gsc_Context *ctx, const char *name)
+{
+	return vm_key(ctx->vm, name);
+}
+
+static Variable *stack_object(gsc_Context *ctx, int obj_index)
+{
+	Variable *ov = vm_stack(ctx->vm, obj_index);
+	if(ov->type != VAR_OBJECT)
+		vm_error(ctx->vm, "'%s' is not an object", variable_type_names[ov->type]);
+	return ov;
+}
+
+GSC_API void gsc_object_get_field_key(gsc_Context *ctx, int obj_index, gsc_Key key)
+{
+	vm_get_field_key(ctx->vm, stack_object(ctx, obj_index), key);
+}
+
+GSC_API void gsc_object_set_field_key(gsc_Context *ctx, int obj_index, gsc_Key key)
+{
+	vm_set_field_key(ctx->vm, stack_object(ctx, obj_index), key);
+}
+
+GSC_API void gsc_handle_get_field_key(gsc_Context *ctx, gsc_Handle handle, gsc_Key key)
+{
+	Variable v = handle_variable(ctx, handle);
+	vm_get_field_key(ctx->vm, &v, key);
+}
+
+GSC_API void gsc_handle_set_field_key(gsc_Context *ctx, gsc_Handle handle, gsc_Key key)
+{
+	Variable v = handle_variable(ctx, handle);
+	vm_set_field_key(ctx->vm, &v, key);
+}
+
+GSC_API int gsc_handle_call_method(gsc_Context *ctx, gsc_Handle handle, const char *file, const char *function, int nargs)
+{
+	Variable self = handle_variable(ctx, handle);
+	vm_pushvar(ctx->vm, &self);
+	return gsc_call_method(ctx, file, function, nargs);
+}
+
+GSC_API int gsc_handle_invoke_method(gsc_Context *ctx, gsc_Handle handle, gsc_ScriptFunction *function, int nargs)
+{
+	Variable self = handle_variable(ctx, handle);
+	vm_pushvar(ctx->vm, &self);
+	return gsc_invoke_method(ctx, function, nargs);
+}
+
 GSC_API void gsc_object_set_userdata(gsc_Context *ctx, int obj_index, void *userdata)
 {
 	Variable *ov = vm_stack(ctx->vm, obj_index);
@@ -456,6 +1086,36 @@ GSC_API int gsc_get_global(gsc_Context *ctx, const char *name)
 	return gsc_top(ctx) - 1;
 }
 
+static void lower_intrinsics(gsc_Context *ctx, CompiledFile *cf, CompiledFunction *f)
+{
+	for(int i = 0; i < f->instruction_count; ++i)
+	{
+		Instruction *ins = &f->instructions[i];
+		if(ins->opcode != OP_INTRINSIC_CALL)
+			continue;
+		int intrinsic = (int)ins->operands[0].value.integer;
+		if(!(ctx->vm->intrinsics & (1u << intrinsic)))
+			continue;
+		// Script functions with the same name take precedence
+		if(hash_trie_upsert(&cf->functions, gsc_string(ctx, ins->operands[1].value.string_index), NULL, false))
+			continue;
+		ins->opcode = OP_INTRINSIC;
+	}
+}
+
+GSC_API int gsc_register_intrinsic(gsc_Context *ctx, const char *name)
+{
+	for(int i = 0; i < INTRINSIC_MAX; ++i)
+	{
+		if(!strcmp(intrinsics[i].name, name))
+		{
+			ctx->vm->intrinsics |= 1u << i;
+			return GSC_OK;
+		}
+	}
+	return GSC_NOT_FOUND;
+}
+
 GSC_API int gsc_link(gsc_Context *state)
 {
 	CHECK_OOM(state);
@@ -487,6 +1147,22 @@ GSC_API int gsc_link(gsc_Context *state)
 			}
 		}
 	}
+	// Calls that have an intrinsic are only lowered now that the functions of the includes are known
+	for(HashTrieNode *it = state->files.head; it; it = it->next)
+	{
+		CompiledFile *cf = it->value;
+		if(cf->state != COMPILE_STATE_DONE)
+			continue;
+		for(HashTrieNode *func_it = cf->functions.head; func_it; func_it = func_it->next)
+		{
+			CompiledFunction *f = func_it->value;
+			// Functions merged in from an include are lowered with their own file
+			if(f->file == cf)
+				lower_intrinsics(state, cf, f);
+		}
+	}
+	// Compiling is done, don't hold on to the scratch memory
+	arena_trim(&state->temp);
 	return GSC_OK;
 }
 
@@ -592,9 +1268,8 @@ static void info(gsc_Context *state)
 	// 	   (float)(HEAP_SIZE - TEMP_SIZE - STRTAB_SIZE) / 1024.f / 1024.f);
 	// printf("[INFO] temp %.2f MB\n",
 	// 	   arena_available_mib(&state->temp));
-	// printf("[INFO] strings text usage:%.2f, entry usage:%.2f / %.2f MB available\n",
-	// 	   arena_available_mib(&state->strtab.begin),
-	// 	   arena_available_mib(&state->strtab.end),
+	// printf("[INFO] strings %.2f / %.2f MB available\n",
+	// 	   string_table_available_mib(&state->strtab),
 	// 	   (float)STRTAB_SIZE / 1024.f / 1024.f);
 	// int thread_count(VM * vm);
 	// printf("[INFO] %d threads\n", thread_count(state->vm));
@@ -619,6 +1294,7 @@ GSC_API int gsc_update(gsc_Context *state, float dt) // TODO: FIXME mode INFINIT
 	// // getchar();
 	CHECK_ERROR(state);
 	CHECK_OOM(state);
+	run_commands(state);
 	if(!vm_run_threads(state->vm, dt))
 		return GSC_OK;
 	// static bool once = false;
@@ -630,6 +1306,31 @@ GSC_API int gsc_update(gsc_Context *state, float dt) // TODO: FIXME mode INFINIT
 	return GSC_YIELD;
 }
 
+GSC_API int gsc_update_budgeted(gsc_Context *state, float dt, const gsc_UpdateBudget *budget, gsc_UpdateReport *report)
+{
+	CHECK_ERROR(state);
+	CHECK_OOM(state);
+	VM *vm = state->vm;
+	run_commands(state);
+	int64_t instructions = vm->instructions;
+	vm_set_budget(vm, budget ? budget->max_instructions : 0, budget ? budget->max_time_ms : 0.0);
+	bool alive = vm_run_threads(vm, dt);
+	Thread *preempted = vm->out_of_budget;
+	vm_set_budget(vm, 0, 0.0);
+	if(report)
+	{
+		report->frame_complete = !vm->frame_started;
+		report->instructions = vm->instructions - instructions;
+		report->threads_run = vm->threads_run;
+		report->threads_deferred = vm->threads_deferred;
+		if(vm->frame_started)
+			report->threads_deferred += vm->running.count - vm->run_index - 1;
+		report->preempted_thread = preempted ? (int)preempted->id : -1;
+		report->preempted_instructions = preempted ? preempted->instructions : 0;
+	}
+	return alive ? GSC_YIELD : GSC_OK;
+}
+
 static const char *intern_string(gsc_Context *ctx, const char *s)
 {
 	return gsc_string(ctx, gsc_register_string(ctx, s));
@@ -662,6 +1363,78 @@ GSC_API int gsc_call(gsc_Context *state, const char *namespace, const char *func
 	return GSC_OK; // TODO: FIXME
 }
 
+GSC_API gsc_ScriptFunction *gsc_find_function(gsc_Context *ctx, const char *file, const char *function)
+{
+	return (gsc_ScriptFunction *)get_function(ctx, file, function);
+}
+
+static int invoke(gsc_Context *ctx, gsc_ScriptFunction *function, int nargs, Variable *self)
+{
+	CHECK_ERROR(ctx);
+	// Nested calls from functions keep the jump buffer of the update that's running
+	if(ctx->vm->thread == &ctx->vm->temp_thread)
+	{
+		CHECK_OOM(ctx);
+	}
+	if(!function)
+		vm_error(ctx->vm, "Invoking a function that doesn't exist");
+	vm_invoke(ctx->vm, (CompiledFunction *)function, nargs, self);
+	return GSC_OK;
+}
+
+GSC_API int gsc_invoke(gsc_Context *ctx, gsc_ScriptFunction *function, int nargs)
+{
+	return invoke(ctx, function, nargs, NULL);
+}
+
+GSC_API int gsc_invoke_method(gsc_Context *ctx, gsc_ScriptFunction *function, int nargs)
+{
+	Variable self = vm_pop(ctx->vm);
+	return invoke(ctx, function, nargs, &self);
+}
+
+GSC_API int gsc_spawn_threads(gsc_Context *ctx, gsc_ScriptFunction *function, void **objects, int count, int nargs, gsc_PushArguments push_arguments, void *userdata)
+{
+	CHECK_ERROR(ctx);
+	// Natives spawning threads keep the jump buffer of the update that's running
+	if(ctx->vm->thread == &ctx->vm->temp_thread)
+	{
+		CHECK_OOM(ctx);
+	}
+	VM *vm = ctx->vm;
+	if(!function)
+		vm_error(vm, "Spawning threads of a function that doesn't exist");
+	double start = vm_clock_ms();
+	vm_spawn_threads(vm, (CompiledFunction *)function, (Object **)objects, count, nargs, (void (*)(void *, int, void *))push_arguments, userdata);
+	vm->batch_spawned += count;
+	vm->batch_spawn_ms += vm_clock_ms() - start;
+	return GSC_OK;
+}
+
+GSC_API int gsc_scatter_field(gsc_Context *ctx, void **objects, int count, gsc_Key key, int type, const void *data, size_t stride)
+{
+	CHECK_ERROR(ctx);
+	if(ctx->vm->thread == &ctx->vm->temp_thread)
+	{
+		CHECK_OOM(ctx);
+	}
+	vm_scatter_field(ctx->vm, (Object **)objects, count, key, type, data, stride);
+	return GSC_OK;
+}
+
+GSC_API int gsc_gather_field(gsc_Context *ctx, void **objects, int count, gsc_Key key, int type, void *data, size_t stride, int *written)
+{
+	CHECK_ERROR(ctx);
+	if(ctx->vm->thread == &ctx->vm->temp_thread)
+	{
+		CHECK_OOM(ctx);
+	}
+	int n = vm_gather_field(ctx->vm, (Object **)objects, count, key, type, data, stride);
+	if(written)
+		*written = n;
+	return GSC_OK;
+}
+
 GSC_API int gsc_push_object(gsc_Context *state, void *object)
 {
 	return vm_pushobject(state->vm, object);
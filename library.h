@@ -4,6 +4,7 @@
 #include "vm.h"
 #include "include/gsc.h"
 #include "hash_trie.h"
+#include "command_queue.h"
 
 struct gsc_Context
 {
@@ -11,9 +12,13 @@ struct gsc_Context
 	
 	gsc_CreateOptions options;
 	Allocator allocator;
+	Allocator host_allocator; // options.allocate_memory/free_memory
 	char *heap;
 	Arena perm;
 	Arena temp;
+	ArenaInfo perm_info;
+	ArenaInfo temp_info;
+	ArenaInfo strtab_info;
 	// HashTrie c_functions;
 	// HashTrie c_methods;
 
@@ -31,4 +36,7 @@ struct gsc_Context
 	jmp_buf jmp_oom;
 
 	Object *default_object_proxy;
+
+	CommandQueue commands; // Posted from other threads, see gsc_post_notify
+	int64_t commands_dropped;
 };
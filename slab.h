@@ -0,0 +1,142 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include "allocator.h"
+
+// Size-class slab allocator
+// Every class hands out fixed size slots which are carved on demand from large chunks,
+// freed slots go on a per class free list and are reused before carving new ones.
+
+#define SLAB_MAX_CLASSES (16)
+#define SLAB_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define SLAB_INITIAL_CHUNK_SIZE (2 * 1024) // Chunks double in size per class until they reach the chunk size
+
+typedef struct SlabChunk SlabChunk;
+
+struct SlabChunk
+{
+	SlabChunk *next;
+	size_t size;
+};
+
+typedef struct
+{
+	const char *name;
+	int slot_size;
+	int alignment;
+	void *free_list;
+	char *beg, *end; // Part of the newest chunk that hasn't been carved yet
+	SlabChunk *chunks;
+	int chunk_count;
+	size_t reserved_bytes;
+	size_t live;
+	size_t peak;
+	size_t allocations;
+} SlabClass;
+
+typedef struct
+{
+	Allocator *allocator;
+	size_t chunk_size;
+	SlabClass classes[SLAB_MAX_CLASSES];
+	int class_count;
+} Slab;
+
+#ifndef align_up
+	#define align_up(addr, align) (((addr) + ((align) - 1)) & ~((align) - 1))
+#endif
+
+static void slab_init(Slab *slab, Allocator *allocator, size_t chunk_size)
+{
+	memset(slab, 0, sizeof(Slab));
+	slab->allocator = allocator;
+	slab->chunk_size = chunk_size ? chunk_size : SLAB_DEFAULT_CHUNK_SIZE;
+}
+
+static int slab_add_class(Slab *slab, const char *name, size_t size, size_t alignment)
+{
+	if(slab->class_count >= SLAB_MAX_CLASSES)
+		return -1;
+	if(alignment < _Alignof(void *))
+		alignment = _Alignof(void *);
+	if(size < sizeof(void *))
+		size = sizeof(void *);
+	SlabClass *cls = &slab->classes[slab->class_count];
+	memset(cls, 0, sizeof(SlabClass));
+	cls->name = name;
+	cls->alignment = (int)alignment;
+	cls->slot_size = (int)align_up(size, alignment);
+	return slab->class_count++;
+}
+
+static bool slab_grow_(Slab *slab, SlabClass *cls)
+{
+	size_t n = SLAB_INITIAL_CHUNK_SIZE;
+	for(int i = 0; i < cls->chunk_count && n < slab->chunk_size; ++i)
+		n *= 2;
+	if(n > slab->chunk_size)
+		n = slab->chunk_size;
+	if(n < sizeof(SlabChunk) + cls->alignment + cls->slot_size)
+		n = sizeof(SlabChunk) + cls->alignment + cls->slot_size;
+	SlabChunk *chunk = (SlabChunk *)slab->allocator->malloc(slab->allocator->ctx, n);
+	if(!chunk)
+		return false;
+	chunk->size = n;
+	chunk->next = cls->chunks;
+	cls->chunks = chunk;
+	cls->chunk_count++;
+	cls->reserved_bytes += n;
+	cls->beg = (char *)align_up((uintptr_t)(chunk + 1), cls->alignment);
+	cls->end = (char *)chunk + n;
+	return true;
+}
+
+static void *slab_allocate(Slab *slab, int class_index)
+{
+	SlabClass *cls = &slab->classes[class_index];
+	void *ptr = cls->free_list;
+	if(ptr)
+	{
+		cls->free_list = *(void **)ptr;
+	}
+	else
+	{
+		if(cls->end - cls->beg < cls->slot_size && !slab_grow_(slab, cls))
+			return NULL;
+		ptr = cls->beg;
+		cls->beg += cls->slot_size;
+	}
+	if(++cls->live > cls->peak)
+		cls->peak = cls->live;
+	cls->allocations++;
+	return ptr;
+}
+
+static void slab_deallocate(Slab *slab, int class_index, void *ptr)
+{
+	if(!ptr)
+		return;
+	SlabClass *cls = &slab->classes[class_index];
+	*(void **)ptr = cls->free_list;
+	cls->free_list = ptr;
+	cls->live--;
+}
+
+static void slab_destroy(Slab *slab)
+{
+	for(int i = 0; i < slab->class_count; ++i)
+	{
+		SlabClass *cls = &slab->classes[i];
+		for(SlabChunk *it = cls->chunks; it;)
+		{
+			SlabChunk *next = it->next;
+			slab->allocator->free(slab->allocator->ctx, it);
+			it = next;
+		}
+		cls->chunks = NULL;
+		cls->free_list = NULL;
+		cls->beg = cls->end = NULL;
+	}
+}
@@ -7,24 +7,27 @@
 
 #define STRING_TABLE_ARY (2)
 
+// Entries are allocated in pages so the table can grow with a chained arena without moving entries
+#define STRING_TABLE_PAGE_SHIFT (8)
+#define STRING_TABLE_PAGE_SIZE (1 << STRING_TABLE_PAGE_SHIFT)
+
 typedef struct StringTableEntry StringTableEntry;
 struct StringTableEntry
 {
 	StringTableEntry *child[1 << STRING_TABLE_ARY];
-	int offset;
+	const char *string;
+	int index;
 	// int length;
-	// int index;
 };
 
 typedef struct
 {
 	StringTableEntry *head;
-	Arena begin; // strings
-	Arena end;	 // entries
-	char *strings;
-	StringTableEntry *entries; // array
-	int index;				   // index into entries array
-    int max_entries;
+	Arena arena; // strings and entries
+	StringTableEntry **pages;
+	int page_count;
+	int page_capacity;
+	int index; // index of the next entry
 } StringTable;
 
 static uint64_t string_table_hash_(const char *s)
@@ -40,34 +43,51 @@ static uint64_t string_table_hash_(const char *s)
 
 static void string_table_init(StringTable *table, Arena arena)
 {
-	ptrdiff_t sz = arena.end - arena.beg;
-	// assert(sz > 0 && (sz & (sz - 1) == 0));
-	int h = sz >> 1;
-	arena_init(&table->begin, arena.beg, h);
-	arena_init(&table->end, arena.beg + h, h);
-	table->begin.jmp_oom = arena.jmp_oom;
-	table->end.jmp_oom = arena.jmp_oom;
-
-    table->max_entries = (h / sizeof(StringTableEntry)) - sizeof(StringTableEntry);
-    table->entries = new(&table->end, StringTableEntry, table->max_entries);
-    table->index = 0;
-	table->strings = table->begin.beg;
+	table->arena = arena;
+	table->pages = NULL;
+	table->page_count = 0;
+	table->page_capacity = 0;
+	table->index = 0;
 	table->head = NULL;
 }
 
 static float string_table_available_mib(StringTable *table)
 {
-	return arena_available_mib(&table->begin) + arena_available_mib(&table->end);
+	return arena_available_mib(&table->arena);
+}
+
+static StringTableEntry *string_table_entry_(StringTable *table, int index)
+{
+	return &table->pages[index >> STRING_TABLE_PAGE_SHIFT][index & (STRING_TABLE_PAGE_SIZE - 1)];
 }
 
 static const char *string_table_get(StringTable *table, int index)
 {
-	if(index < 0 || index >= table->max_entries)
+	if(index < 0 || index >= table->index)
 	{
 		return NULL;
 	}
-	return table->entries[index].offset + table->strings;
-	// return table->strings + index;
+	return string_table_entry_(table, index)->string;
+}
+
+static StringTableEntry *string_table_new_entry_(StringTable *table)
+{
+	if(table->index == table->page_count * STRING_TABLE_PAGE_SIZE)
+	{
+		if(table->page_count == table->page_capacity)
+		{
+			int n = table->page_capacity ? table->page_capacity * 2 : 16;
+			StringTableEntry **pages = new(&table->arena, StringTableEntry *, n);
+			if(table->page_count > 0)
+				memcpy(pages, table->pages, sizeof(StringTableEntry *) * table->page_count);
+			table->pages = pages;
+			table->page_capacity = n;
+		}
+		table->pages[table->page_count++] = new(&table->arena, StringTableEntry, STRING_TABLE_PAGE_SIZE);
+	}
+	StringTableEntry *entry = string_table_entry_(table, table->index);
+	entry->index = table->index++;
+	return entry;
 }
 
 static int string_table_intern(StringTable *table, const char *string)
@@ -75,23 +95,17 @@ static int string_table_intern(StringTable *table, const char *string)
 	StringTableEntry **m = &table->head;
 	for(uint64_t h = string_table_hash_(string); *m; h <<= STRING_TABLE_ARY)
 	{
-		if(!strcmp(table->strings + (*m)->offset, string))
+		if(!strcmp((*m)->string, string))
 		{
-			// return (*m)->offset;
-			return (*m) - table->entries;
+			return (*m)->index;
 		}
 		m = &(*m)->child[h >> (64 - STRING_TABLE_ARY)];
 	}
 	size_t n = strlen(string) + 1;
-	char *duplicate = new(&table->begin, char, n);
+	char *duplicate = new(&table->arena, char, n);
 	memcpy(duplicate, string, n);
-    if(table->index >= table->max_entries)
-		longjmp(*table->end.jmp_oom, 1);
-	StringTableEntry *entry = &table->entries[table->index++];
-	// StringTableEntry *entry = new(&table->end, StringTableEntry, 1);
-	entry->offset = duplicate - table->strings;
-	// entry->index = table->index++;
+	StringTableEntry *entry = string_table_new_entry_(table);
+	entry->string = duplicate;
 	*m = entry;
-	// return entry->offset;
-	return table->index - 1;
+	return entry->index;
 }
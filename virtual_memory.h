@@ -0,0 +1,60 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+
+// Reserve address space without backing it, pages are committed as the arena grows
+
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+
+static char *virtual_memory_reserve(size_t size)
+{
+	return (char *)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+static bool virtual_memory_commit(char *ptr, size_t size)
+{
+	return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+static void virtual_memory_release(char *ptr, size_t size)
+{
+	VirtualFree(ptr, 0, MEM_RELEASE);
+}
+#elif defined(EMSCRIPTEN)
+static char *virtual_memory_reserve(size_t size)
+{
+	return NULL;
+}
+
+static bool virtual_memory_commit(char *ptr, size_t size)
+{
+	return false;
+}
+
+static void virtual_memory_release(char *ptr, size_t size)
+{
+}
+#else
+	#include <sys/mman.h>
+
+static char *virtual_memory_reserve(size_t size)
+{
+	#ifndef MAP_NORESERVE
+		#define MAP_NORESERVE (0)
+	#endif
+	void *ptr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return ptr == MAP_FAILED ? NULL : (char *)ptr;
+}
+
+static bool virtual_memory_commit(char *ptr, size_t size)
+{
+	return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+static void virtual_memory_release(char *ptr, size_t size)
+{
+	munmap(ptr, size);
+}
+#endif
@@ -10,23 +10,7 @@
 #ifndef MAX
 	#define MAX(A, B) ((A) > (B) ? (A) : (B))
 #endif
-// enum
-// {
-// 	UNION_OBJECT_SIZE =
-// 		MAX(1, MAX(1, MAX(sizeof_ObjectField, MAX(sizeof_Variable, sizeof_Object))))
-// 	// sizeof_Unit =
-// 	// 	MAX(sizeof_Thread, MAX(sizeof_StackFrame, MAX(sizeof_ObjectField, MAX(sizeof_Variable, sizeof_Object))))
-// };
-typedef struct
-{
-	// char data[UNION_OBJECT_SIZE];
-	char data[72]; // 64 so we can allocate small strings too
-	// increased to 72 for Object
-} UnionObject;
 
-DEFINE_OBJECT_POOL(thread, Thread)
-DEFINE_OBJECT_POOL(stack_frame, StackFrame)
-DEFINE_OBJECT_POOL(uo, UnionObject)
 // DEFINE_OBJECT_POOL(object_field, ObjectField)
 // DEFINE_OBJECT_POOL(variable, Variable)
 // DEFINE_OBJECT_POOL(object, Object)
@@ -57,13 +41,21 @@ StackFrame *stack_frame(VM *vm, Thread *t)
 	return &t->frames[t->bp];
 }
 
+static void detach_thread(Thread *t);
+static void cancel_object_timers(VM *vm, Object *o);
+
 static void free_object(VM *vm, Object *o)
 {
+	while(o->threads)
+		detach_thread(o->threads);
+	if(o->timer_count > 0)
+		cancel_object_timers(vm, o);
 	for(ObjectField *it = o->fields; it;)
 	{
 		ObjectField *field = it;
 		it = it->next;
-		object_pool_deallocate(&vm->pool.uo, field);
+		slab_deallocate(&vm->slab, VM_SLAB_VARIABLE, field->value);
+		slab_deallocate(&vm->slab, VM_SLAB_OBJECT_FIELD, field);
 	}
 	o->tail = NULL;
 	o->refcount = 0;
@@ -111,14 +103,23 @@ Variable vm_intern_string_variable(VM *vm, const char *str)
 	return v;
 }
 
+static int string_slab_class(size_t len)
+{
+	if(len <= 16)
+		return VM_SLAB_STRING_16;
+	if(len <= 32)
+		return VM_SLAB_STRING_32;
+	return VM_SLAB_STRING_64;
+}
+
 VariableString allocate_variable_string(VM *vm, int len) // len is including \0
 {
 	// if(len == -1)
 	// 	len = strlen(str) + 1;
 	char *ptr = NULL;
-	if(len <= 64)
+	if(len <= VM_MAX_SLAB_STRING_LENGTH)
 	{
-		ptr = (char *)object_pool_allocate(&vm->pool.uo, char);
+		ptr = (char *)slab_allocate(&vm->slab, string_slab_class(len));
 		if(!ptr)
 			vm_error(vm, "No strings left");
 	}
@@ -183,11 +184,7 @@ static void print_stackframe(Thread *thr)
 
 int thread_count(VM *vm)
 {
-	if(vm->thread_write_idx >= vm->thread_read_idx)
-	{
-		return vm->thread_write_idx - vm->thread_read_idx;
-	}
-	return vm->max_threads - (vm->thread_read_idx - vm->thread_write_idx);
+	return vm->thread_count;
 }
 
 #pragma pack(push, 8)
@@ -202,9 +199,11 @@ typedef struct
 
 int get_thread_info_(VM *vm, ThreadDebugInfo_ *info, int i)
 {
-	if(vm->thread_read_idx == vm->thread_write_idx)
+	Thread *t = vm->threads;
+	for(int k = 0; t && k < i; ++k)
+		t = t->next;
+	if(!t)
 		return 0; // No threads
-	Thread *t = vm->thread_buffer[(vm->thread_read_idx + i) % vm->max_threads];
 	info->frames = t->frames;
 	info->bp = t->bp;
 	info->index = i;
@@ -214,15 +213,15 @@ int get_thread_info_(VM *vm, ThreadDebugInfo_ *info, int i)
 
 void vm_print_thread_info(VM *vm)
 {
-	if(vm->thread_read_idx == vm->thread_write_idx)
+	if(!vm->threads)
 		return; // No threads
 	printf("[THREADS]\n");
 	size_t n = thread_count(vm);
 	printf("%d %s\n", n, n > 1 ? "threads" : "thread");
 	printf("=========================================\n");
-	for(size_t i = 0; i < n; i++)
+	size_t i = 0;
+	for(Thread *t = vm->threads; t; t = t->next, i++)
 	{
-		Thread *t = vm->thread_buffer[(vm->thread_read_idx + i) % vm->max_threads];
     	StackFrame *sf = stack_frame(vm, t);
 		printf("%d: %s %s::%s", i, vm_thread_state_names[t->state], sf->file, sf->function);
 		if(t->state == VM_THREAD_WAITING_EVENT)
@@ -325,7 +324,7 @@ static Variable *local(VM *vm, size_t index)
 		vm_error(vm, "Invalid local index %d/%d", (int)index, (int)sf->local_count);
 		return NULL;
 	}
-	return sf->locals[index];
+	return &sf->locals[index];
 }
 
 static void print_locals(VM *vm)
@@ -399,9 +398,9 @@ static void free_var(VM *vm, Variable *v)
 	{
 		case VAR_STRING:
 		{
-			if(v->u.sval.length <= 64)
+			if(v->u.sval.length <= VM_MAX_SLAB_STRING_LENGTH)
 			{
-				object_pool_deallocate(&vm->pool.uo, v->u.sval.data);
+				slab_deallocate(&vm->slab, string_slab_class(v->u.sval.length), v->u.sval.data);
 			} else
 			{
 				vm_error(vm, "No free!");
@@ -449,7 +448,7 @@ static Variable ref(VM *vm, Variable *referee)
 
 Object *vm_allocate_object(VM *vm)
 {
-	Object *o = object_pool_allocate(&vm->pool.uo, Object);
+	Object *o = slab_allocate(&vm->slab, VM_SLAB_OBJECT);
 	if(!o)
 		vm_error(vm, "No objects left");
 	o->fields = NULL;
@@ -457,7 +456,10 @@ Object *vm_allocate_object(VM *vm)
 	o->refcount = 0;
 	o->field_count = 0;
 	o->proxy = NULL;
+	o->userdata = NULL;
 	o->debug_info = vm->debug_info;
+	o->threads = NULL;
+	o->timer_count = 0;
 	return o;
 }
 
@@ -481,13 +483,60 @@ Variable vm_create_object(VM *vm)
 // 	return dup(vm, v);
 // }
 
+static void grow_stack(VM *vm, Thread *thr, int n)
+{
+	if(n <= thr->stack_size)
+		return;
+	if(n > VM_MAX_STACK_SIZE)
+		vm_error(vm, "stack ptr > max");
+	int size = thr->stack_size ? thr->stack_size : VM_STACK_SIZE;
+	while(size < n)
+		size *= 2;
+	if(size > VM_MAX_STACK_SIZE)
+		size = VM_MAX_STACK_SIZE;
+	Variable *stack = vm->allocator->malloc(vm->allocator->ctx, sizeof(Variable) * size);
+	if(!stack)
+		vm_error(vm, "Failed to allocate stack");
+	if(thr->stack)
+	{
+		memcpy(stack, thr->stack, sizeof(Variable) * thr->sp);
+		vm->allocator->free(vm->allocator->ctx, thr->stack);
+	}
+	thr->stack = stack;
+	thr->stack_size = size;
+}
+
+static void grow_frames(VM *vm, Thread *thr, int n)
+{
+	if(n <= thr->frame_size)
+		return;
+	if(n > VM_MAX_FRAME_SIZE)
+		vm_error(vm, "thr->bp >= VM_MAX_FRAME_SIZE");
+	int size = thr->frame_size ? thr->frame_size : VM_FRAME_SIZE;
+	while(size < n)
+		size *= 2;
+	if(size > VM_MAX_FRAME_SIZE)
+		size = VM_MAX_FRAME_SIZE;
+	StackFrame *frames = vm->allocator->malloc(vm->allocator->ctx, sizeof(StackFrame) * size);
+	if(!frames)
+		vm_error(vm, "Failed to allocate stack frames");
+	memset(frames, 0, sizeof(StackFrame) * size);
+	if(thr->frames)
+	{
+		memcpy(frames, thr->frames, sizeof(StackFrame) * thr->frame_size);
+		vm->allocator->free(vm->allocator->ctx, thr->frames);
+	}
+	thr->frames = frames;
+	thr->frame_size = size;
+}
+
 static void push_thread(VM *vm, Thread *thr, Variable v)
 {
     StackFrame *sf = stack_frame(vm, thr);
 	if(thr->sp < 0)
 		vm_error(vm, "stack ptr < 0");
-	if(thr->sp >= COUNT_OF(thr->stack))
-		vm_error(vm, "stack ptr > max");
+	if(thr->sp >= thr->stack_size)
+		grow_stack(vm, thr, thr->sp + 1);
     thr->stack[thr->sp++] = v;
 }
 
@@ -506,7 +555,7 @@ static Variable pop_thread(VM *vm, Thread *thr)
 {
 	if(thr->sp <= 0)
 		vm_error(vm, "stack ptr < 0");
-	if(thr->sp > COUNT_OF(thr->stack))
+	if(thr->sp > thr->stack_size)
 		vm_error(vm, "stack ptr > max");
     Variable *top = &thr->stack[--thr->sp];
     // Variable ret = *top;
@@ -1128,23 +1177,108 @@ static Variable integer(VM *vm, int64_t i)
 	return v;
 }
 
-void add_thread(VM *vm, Thread *t)
+static void thread_list_reserve(VM *vm, VMThreadList *list, int count)
 {
-	if((vm->thread_write_idx + 1) % vm->max_threads == vm->thread_read_idx)
+	if(count > list->capacity)
 	{
-		vm_error(vm, "Maximum amount of threads reached");
+		int n = list->capacity ? list->capacity : VM_INITIAL_THREAD_LIST_SIZE;
+		while(n < count)
+			n *= 2;
+		Thread **items = vm->allocator->malloc(vm->allocator->ctx, sizeof(Thread *) * n);
+		if(!items)
+			vm_error(vm, "Failed to allocate thread list");
+		if(list->count > 0)
+			memcpy(items, list->items, sizeof(Thread *) * list->count);
+		if(list->items)
+			vm->allocator->free(vm->allocator->ctx, list->items);
+		list->items = items;
+		list->capacity = n;
 	}
-	vm->thread_buffer[vm->thread_write_idx] = t;
-	vm->thread_write_idx = (vm->thread_write_idx + 1) % vm->max_threads;
 }
 
-Thread *remove_thread(VM *vm)
+static void thread_list_push(VM *vm, VMThreadList *list, Thread *t)
 {
-	if(vm->thread_read_idx == vm->thread_write_idx)
-		return NULL;
-	Thread *t = vm->thread_buffer[vm->thread_read_idx];
-	vm->thread_read_idx = (vm->thread_read_idx + 1) % vm->max_threads;
-	return t;
+	if(list->count >= list->capacity)
+		thread_list_reserve(vm, list, list->count + 1);
+	list->items[list->count++] = t;
+}
+
+static bool sleeps_before(Thread *a, Thread *b)
+{
+	if(a->wake_time != b->wake_time)
+		return a->wake_time < b->wake_time;
+	return a->id < b->id;
+}
+
+static void sleeping_swap(VMThreadList *heap, int i, int j)
+{
+	Thread *t = heap->items[i];
+	heap->items[i] = heap->items[j];
+	heap->items[j] = t;
+	heap->items[i]->heap_index = i;
+	heap->items[j]->heap_index = j;
+}
+
+static void sleeping_sift_up(VMThreadList *heap, int i)
+{
+	while(i > 0)
+	{
+		int parent = (i - 1) / 2;
+		if(!sleeps_before(heap->items[i], heap->items[parent]))
+			break;
+		sleeping_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+static void sleeping_sift_down(VMThreadList *heap, int i)
+{
+	for(;;)
+	{
+		int smallest = i;
+		int l = i * 2 + 1;
+		int r = l + 1;
+		if(l < heap->count && sleeps_before(heap->items[l], heap->items[smallest]))
+			smallest = l;
+		if(r < heap->count && sleeps_before(heap->items[r], heap->items[smallest]))
+			smallest = r;
+		if(smallest == i)
+			break;
+		sleeping_swap(heap, i, smallest);
+		i = smallest;
+	}
+}
+
+static void sleep_thread(VM *vm, Thread *t, double wake_time)
+{
+	t->wake_time = wake_time;
+	t->heap_index = vm->sleeping.count;
+	thread_list_push(vm, &vm->sleeping, t);
+	sleeping_sift_up(&vm->sleeping, t->heap_index);
+}
+
+static void wake_thread(VM *vm, Thread *t)
+{
+	VMThreadList *heap = &vm->sleeping;
+	int i = t->heap_index;
+	if(i < 0)
+		return;
+	int last = --heap->count;
+	if(i != last)
+	{
+		heap->items[i] = heap->items[last];
+		heap->items[i]->heap_index = i;
+		sleeping_sift_down(heap, i);
+		sleeping_sift_up(heap, i);
+	}
+	t->heap_index = -1;
+}
+
+// Thread runs next frame, threads that were waiting have to be made active by the caller
+void add_thread(VM *vm, Thread *t)
+{
+	t->queued = true;
+	thread_list_push(vm, &vm->activated, t);
 }
 
 gsc_Function object_get_function(VM *vm, Object *object, const char *function)
@@ -1178,7 +1312,112 @@ gsc_Function object_find_callable(VM *vm, Object *object, const char *callable,
 	return NULL;
 }
 
-static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
+static uint64_t vm_hash_string(const char *s);
+static ObjectField *object_upsert_hashed(VM *vm, Object *o, const char *key, uint64_t hash);
+
+static VMKey *get_key(VM *vm, int key);
+
+// Native fields are stored as integers in the __fields object of a proxy, type | flags << 8 | offset << 16
+#define NATIVE_FIELD_TYPE(binding) ((int)((binding) & 0xff))
+#define NATIVE_FIELD_FLAGS(binding) ((int)(((binding) >> 8) & 0xff))
+#define NATIVE_FIELD_OFFSET(binding) ((size_t)((binding) >> 16))
+
+void vm_bind_native_field(VM *vm, Object *proxy, const char *name, int type, size_t offset, int flags)
+{
+	if(type != VAR_INTEGER && type != VAR_BOOLEAN && type != VAR_FLOAT && type != VAR_VECTOR && type != VAR_STRING)
+		vm_error(vm, "Can't bind '%s' field '%s'", variable_type_names[type], name);
+	if(type == VAR_STRING)
+		flags |= GSC_FIELD_READ_ONLY;
+	VMKey *k = get_key(vm, vm->native_fields_key);
+	Variable *fields = object_upsert_hashed(vm, proxy, k->string, k->hash)->value;
+	if(fields->type != VAR_OBJECT)
+	{
+		*fields = vm_create_object(vm);
+		incref(vm, fields);
+	}
+	int idx = vm_string_index(vm, name);
+	Variable *binding = vm_object_upsert(vm, fields->u.oval, string(vm, idx))->value;
+	*binding = integer(vm, (int64_t)type | (int64_t)(flags & 0xff) << 8 | (int64_t)offset << 16);
+}
+
+// Walks the proxy chain the same way __get and __set are looked up, only objects with userdata can have native fields
+static bool find_native_field(VM *vm, Object *o, const char *prop, uint64_t hash, int64_t *binding)
+{
+	if(!o->userdata)
+		return false;
+	VMKey *k = &vm->keys[vm->native_fields_key];
+	for(Object *proxy = o->proxy; proxy; proxy = proxy->proxy)
+	{
+		ObjectField *fields = object_upsert_hashed(NULL, proxy, k->string, k->hash);
+		if(!fields || fields->value->type != VAR_OBJECT)
+			continue;
+		ObjectField *entry = object_upsert_hashed(NULL, fields->value->u.oval, prop, hash);
+		if(entry && entry->value->type == VAR_INTEGER)
+		{
+			*binding = entry->value->u.ival;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void load_native_field(VM *vm, Object *o, int64_t binding)
+{
+	const char *p = (const char *)o->userdata + NATIVE_FIELD_OFFSET(binding);
+	switch(NATIVE_FIELD_TYPE(binding))
+	{
+		case VAR_INTEGER: vm_pushinteger(vm, *(const int *)p); break;
+		case VAR_BOOLEAN: vm_pushbool(vm, *(const int *)p != 0); break;
+		case VAR_FLOAT: vm_pushfloat(vm, *(const float *)p); break;
+		case VAR_VECTOR: vm_pushvector(vm, (float *)p); break;
+		case VAR_STRING:
+		{
+			const char *str = *(const char *const *)p;
+			if(str)
+				vm_pushstring(vm, str);
+			else
+				vm_pushundefined(vm);
+		}
+		break;
+	}
+}
+
+static void store_native_field(VM *vm, Object *o, int64_t binding, Variable *src)
+{
+	if(NATIVE_FIELD_FLAGS(binding) & GSC_FIELD_READ_ONLY)
+		vm_error(vm, "Field is read only");
+	char *p = (char *)o->userdata + NATIVE_FIELD_OFFSET(binding);
+	int type = NATIVE_FIELD_TYPE(binding);
+	switch(type)
+	{
+		case VAR_INTEGER:
+		case VAR_BOOLEAN:
+			if(src->type == VAR_FLOAT)
+				*(int *)p = (int)src->u.fval;
+			else if(src->type == VAR_INTEGER || src->type == VAR_BOOLEAN)
+				*(int *)p = (int)src->u.ival;
+			else
+				vm_error(vm, "Can't assign '%s' to '%s' field", variable_type_names[src->type], variable_type_names[type]);
+			if(type == VAR_BOOLEAN)
+				*(int *)p = *(int *)p != 0;
+			break;
+		case VAR_FLOAT:
+			if(src->type == VAR_FLOAT)
+				*(float *)p = src->u.fval;
+			else if(src->type == VAR_INTEGER || src->type == VAR_BOOLEAN)
+				*(float *)p = (float)src->u.ival;
+			else
+				vm_error(vm, "Can't assign '%s' to '%s' field", variable_type_names[src->type], variable_type_names[type]);
+			break;
+		case VAR_VECTOR:
+			if(src->type != VAR_VECTOR)
+				vm_error(vm, "Can't assign '%s' to '%s' field", variable_type_names[src->type], variable_type_names[type]);
+			memcpy(p, src->u.vval, sizeof(src->u.vval));
+			break;
+	}
+}
+
+static void load_field(VM *vm, Variable obj, const char *prop, uint64_t hash)
 {
 	if(obj.type == VAR_UNDEFINED)
 	{
@@ -1206,7 +1445,13 @@ static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
 		else
 		{
 			bool handled = false;
-			if(o->proxy)
+			int64_t binding;
+			if(o->proxy && find_native_field(vm, o, prop, hash, &binding))
+			{
+				load_native_field(vm, o, binding);
+				handled = true;
+			}
+			else if(o->proxy)
 			{
 				gsc_Function func = object_find_callable(vm, o, "__get", prop);
 				if(func)
@@ -1228,7 +1473,7 @@ static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
 			}
 			if(!handled)
 			{
-				ObjectField *entry = vm_object_upsert(NULL, o, prop);
+				ObjectField *entry = object_upsert_hashed(NULL, o, prop, hash);
 				if(!entry)
 				{
 					push(vm, undef);
@@ -1242,7 +1487,16 @@ static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
 	}
 }
 
+static void op_load_field_object_(VM *vm, Variable obj, const char *prop)
+{
+	load_field(vm, obj, prop, vm_hash_string(prop));
+}
+
 static bool call_function(VM *vm, Thread*, const char *file, const char *function, int function_string_index, size_t nargs, bool, int);
+static void free_locals(VM *vm, Thread *thr, StackFrame *sf);
+static void attach_thread(Thread *t);
+static Thread *allocate_thread(VM *vm);
+static void call_intrinsic(VM *vm, Thread *thr, int intrinsic);
 #define ASSERT_STACK(X)                                                              \
 	do                                                                               \
 	{                                                                                \
@@ -1375,7 +1629,20 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 			}
 
 			bool handled = false;
-			if(o->proxy)
+			int64_t binding;
+			if(o->proxy && find_native_field(vm, o, prop, vm_hash_string(prop), &binding))
+			{
+				// Stored by OP_STORE straight into the userdata, a native function without a function marks it
+				push(vm, *obj);
+				push(vm, integer(vm, binding));
+				Variable v = var(vm);
+				v.type = VAR_FUNCTION;
+				v.u.funval.is_native = true;
+				v.u.funval.native_function = NULL;
+				push(vm, v);
+				handled = true;
+			}
+			else if(o->proxy)
 			{
 				gsc_Function func = object_find_callable(vm, o, "__set", prop);
 				if(func)
@@ -1446,7 +1713,15 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 
 		case OP_STORE:
 		{
-			if(gsc_type(vm->ctx, -1) == VAR_FUNCTION)
+			if(gsc_type(vm->ctx, -1) == VAR_FUNCTION && vm_stack_top(vm, -1)->u.funval.is_native && !vm_stack_top(vm, -1)->u.funval.native_function)
+			{
+				pop(vm);
+				int64_t binding = pop(vm).u.ival;
+				Variable obj = pop(vm);
+				store_native_field(vm, obj.u.oval, binding, vm_stack_top(vm, -1));
+				// src
+			}
+			else if(gsc_type(vm->ctx, -1) == VAR_FUNCTION)
 			{
 				Variable dst = pop(vm);
 
@@ -1475,8 +1750,7 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 				// {
 				// 	free(dst->u.sval);
 				// }
-				dst->type = src.type;
-				memcpy(&dst->u, &src.u, sizeof(dst->u));
+				*dst = src;
 				// decref(vm, &dst);
 				push(vm, *dst);
 				ASSERT_STACK(-1);
@@ -1643,11 +1917,7 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 			if(thr->bp < 0)
 				vm_error(vm, "bp < 0");
 
-			// buf_free(sf->locals);
-			for(int i = 0; i < sf->local_count; i++)
-			{
-				object_pool_deallocate(&vm->pool.uo, sf->locals[i]);
-			}
+			free_locals(vm, thr, sf);
 			if(--thr->bp < 0)
 			{
 				thr->state = VM_THREAD_INACTIVE;
@@ -1721,12 +1991,8 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 
 			if(call_flags & VM_CALL_FLAG_THREADED)
 			{
-				Thread *nt = object_pool_allocate(&vm->pool.threads, Thread);
-				if(!nt)
-					vm_error(vm, "No threads left");
-				memset(nt, 0, sizeof(Thread));
-				nt->bp = 0;
-				nt->state = VM_THREAD_ACTIVE;
+				Thread *nt = allocate_thread(vm);
+				nt->priority = thr->priority;
 				pop_thread(vm, thr); //nargs
 				
 				for(size_t k = 0; k < nargs + 1; ++k)
@@ -1734,10 +2000,10 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 					Variable arg = pop_thread(vm, thr);
 					push_thread(vm, nt, arg);
 				}
-				push_thread(vm, thr, undef); // return value for caller thread
-				nt->return_value = &thr->stack[thr->sp - 1]; // TODO: FIXME
+				push_thread(vm, thr, undef); // return value for caller thread, the result of the new thread is discarded
 				push_thread(vm, nt, integer(vm, nargs));
-				call_function(vm, nt, file, function_name, function, nargs, true, call_flags);
+				if(call_function(vm, nt, file, function_name, function, nargs, true, call_flags))
+					attach_thread(nt);
 				nt->caller.file = sf->file;
 				nt->caller.function = sf->function;
 				add_thread(vm, nt);
@@ -1746,8 +2012,8 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 			}
 			else
 			{
-				if(++thr->bp >= VM_FRAME_SIZE)
-					vm_error(vm, "thr->bp >= VM_FRAME_SIZE");
+				if(++thr->bp >= thr->frame_size)
+					grow_frames(vm, thr, thr->bp + 1);
 				if(!call_function(vm, thr, file, function_name, function, nargs, false, call_flags))
 					thr->bp--;
 			}
@@ -1755,6 +2021,66 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 		}
 		break;
 
+		// Not lowered by gsc_link, the arguments are on the stack like for OP_CALL without self and the argument count
+		case OP_INTRINSIC_CALL:
+		{
+			int intrinsic = read_int(vm, ins, 0);
+			int function = read_string_index(vm, ins, 1);
+			int nargs = intrinsics[intrinsic].argc;
+			push(vm, *local(vm, 0));
+			push(vm, integer(vm, nargs));
+			const char *function_name = string(vm, function);
+			vm->debug_info.function = function_name;
+			if(++thr->bp >= thr->frame_size)
+				grow_frames(vm, thr, thr->bp + 1);
+			if(!call_function(vm, thr, sf->file, function_name, function, nargs, false, 0))
+				thr->bp--;
+		}
+		break;
+
+		case OP_INTRINSIC:
+		{
+			int intrinsic = read_int(vm, ins, 0);
+			call_intrinsic(vm, thr, intrinsic);
+			ASSERT_STACK(1 - intrinsics[intrinsic].argc);
+		}
+		break;
+
+		// Operands: event name or none when it's on the stack, number of event arguments
+		case OP_NOTIFY:
+		case OP_WAITTILL:
+		case OP_ENDON:
+		{
+			Variable self = pop(vm);
+			if(self.type != VAR_OBJECT)
+			{
+				vm_error(vm, "'%s' is not an object", variable_type_names[self.type]);
+			}
+			int name;
+			bool constant_name = check_operand(ins, 0, OPERAND_TYPE_INDEXED_STRING);
+			if(constant_name)
+			{
+				name = read_string_index(vm, ins, 0);
+			}
+			else
+			{
+				Variable key = pop(vm);
+				name = key.type == VAR_INTERNED_STRING ? key.u.ival : vm_string_index(vm, vm_cast_string(vm, &key));
+			}
+			int numargs = read_int(vm, ins, 1);
+			Variable *args = &thr->stack[thr->sp - 1];
+			switch(ins->opcode)
+			{
+				case OP_NOTIFY: vm_notify_event(vm, self.u.oval, name, args, numargs); break;
+				case OP_WAITTILL: vm_waittill(vm, thr, self.u.oval, name, args, numargs); break;
+				case OP_ENDON: vm_subscribe(vm, thr, self.u.oval, name, VM_SUBSCRIPTION_ENDON); break;
+			}
+			thr->sp -= numargs;
+			push(vm, undef); // Result of the call, a waiting thread resumes with it
+			ASSERT_STACK(-numargs - (constant_name ? 0 : 1));
+		}
+		break;
+
 		case OP_BINOP:
 		{
 			int op = read_int(vm, ins, 0);
@@ -1786,6 +2112,8 @@ bool vm_execute_instruction(VM *vm, Instruction *ins)
 
 void vm_cleanup(VM* vm)
 {
+	slab_destroy(&vm->slab);
+	arena_release(&vm->c_function_arena_info);
 }
 
 // static uint64_t permute64(uint64_t x)
@@ -1817,9 +2145,15 @@ static uint64_t vm_hash_string(const char *s)
 #endif
 
 ObjectField *vm_object_upsert(VM *vm, Object *o, const char *key)
+{
+	return object_upsert_hashed(vm, o, key, vm_hash_string(key));
+}
+
+// Keys are usually interned, so comparing the pointers first skips most of the string compares
+static ObjectField *object_upsert_hashed(VM *vm, Object *o, const char *key, uint64_t hash)
 {
 	ObjectField **m = &o->fields;
-	for(uint64_t h = vm_hash_string(key);; h <<= 2)
+	for(uint64_t h = hash;; h <<= 2)
 	{
 		if(!*m)
 		{
@@ -1834,13 +2168,13 @@ ObjectField *vm_object_upsert(VM *vm, Object *o, const char *key)
 				o->tail = &o->fields;
 			}
 
-			ObjectField *new_node = object_pool_allocate(&vm->pool.uo, ObjectField);
+			ObjectField *new_node = slab_allocate(&vm->slab, VM_SLAB_OBJECT_FIELD);
 			if(!new_node)
 				vm_error(vm, "No object fields left");
 			o->field_count++;
 			memset(new_node, 0, sizeof(ObjectField));
 			new_node->key = key;
-			Variable *v = object_pool_allocate(&vm->pool.uo, Variable);
+			Variable *v = slab_allocate(&vm->slab, VM_SLAB_VARIABLE);
 			if(!v)
 				vm_error(vm, "No variables left");
 			v->type = VAR_UNDEFINED;
@@ -1852,7 +2186,7 @@ ObjectField *vm_object_upsert(VM *vm, Object *o, const char *key)
 			o->tail = &new_node->next;
 			return new_node;
 		}
-		if(!stricmp((*m)->key, key))
+		if((*m)->key == key || !stricmp((*m)->key, key))
 		{
 			return *m;
 		}
@@ -1913,6 +2247,126 @@ void vm_set_object_field(VM *vm, int obj_index, const char *key)
 	*entry->value = pop(vm);
 }
 
+int vm_key(VM *vm, const char *name)
+{
+	HashTrieNode *entry = hash_trie_upsert(&vm->key_lookup, name, vm->allocator, true);
+	if(entry->value)
+		return (int)(intptr_t)entry->value - 1;
+	if(vm->key_count == vm->key_capacity)
+	{
+		int n = vm->key_capacity ? vm->key_capacity * 2 : VM_INITIAL_KEY_COUNT;
+		VMKey *keys = vm->allocator->malloc(vm->allocator->ctx, sizeof(VMKey) * n);
+		if(!keys)
+			vm_error(vm, "Failed to allocate keys");
+		if(vm->key_count > 0)
+		{
+			memcpy(keys, vm->keys, sizeof(VMKey) * vm->key_count);
+			vm->allocator->free(vm->allocator->ctx, vm->keys);
+		}
+		vm->keys = keys;
+		vm->key_capacity = n;
+	}
+	VMKey *key = &vm->keys[vm->key_count];
+	key->index = vm_string_index(vm, name);
+	key->string = string(vm, key->index);
+	key->hash = vm_hash_string(key->string);
+	entry->value = (void *)(intptr_t)(++vm->key_count);
+	return vm->key_count - 1;
+}
+
+static VMKey *get_key(VM *vm, int key)
+{
+	if(key < 0 || key >= vm->key_count)
+		vm_error(vm, "Invalid key %d", key);
+	return &vm->keys[key];
+}
+
+int vm_key_string_index(VM *vm, int key)
+{
+	return get_key(vm, key)->index;
+}
+
+// Same as loading a field from script, proxies with __get are asked first
+void vm_get_field_key(VM *vm, Variable *ov, int key)
+{
+	VMKey *k = get_key(vm, key);
+	load_field(vm, *ov, k->string, k->hash);
+}
+
+void vm_set_field_key(VM *vm, Variable *ov, int key)
+{
+	VMKey *k = get_key(vm, key);
+	if(ov->type != VAR_OBJECT)
+		vm_error(vm, "'%s' is not an object", variable_type_names[ov->type]);
+	ObjectField *entry = object_upsert_hashed(vm, ov->u.oval, k->string, k->hash);
+	*entry->value = pop(vm);
+}
+
+// Sets the field on every object from a strided array of int, float, float[3] or int for booleans
+void vm_scatter_field(VM *vm, Object **objects, int count, int key, int type, const char *data, size_t stride)
+{
+	VMKey *k = get_key(vm, key);
+	if(type != VAR_INTEGER && type != VAR_FLOAT && type != VAR_VECTOR && type != VAR_BOOLEAN)
+		vm_error(vm, "Can't scatter '%s' fields", variable_type_names[type]);
+	for(int i = 0; i < count; ++i, data += stride)
+	{
+		if(!objects[i])
+			vm_error(vm, "Object %d is null", i);
+		Variable *v = object_upsert_hashed(vm, objects[i], k->string, k->hash)->value;
+		v->type = type;
+		switch(type)
+		{
+			case VAR_INTEGER: v->u.ival = *(const int *)data; break;
+			case VAR_BOOLEAN: v->u.ival = *(const int *)data != 0; break;
+			case VAR_FLOAT: v->u.fval = *(const float *)data; break;
+			case VAR_VECTOR: memcpy(v->u.vval, data, sizeof(v->u.vval)); break;
+		}
+	}
+}
+
+// Reads the field of every object into a strided array, numbers are converted to the type asked for
+// Elements of objects without the field or with a field of another type are left as they are, returns how many were written
+int vm_gather_field(VM *vm, Object **objects, int count, int key, int type, char *data, size_t stride)
+{
+	VMKey *k = get_key(vm, key);
+	if(type != VAR_INTEGER && type != VAR_FLOAT && type != VAR_VECTOR && type != VAR_BOOLEAN)
+		vm_error(vm, "Can't gather '%s' fields", variable_type_names[type]);
+	int written = 0;
+	for(int i = 0; i < count; ++i, data += stride)
+	{
+		if(!objects[i])
+			vm_error(vm, "Object %d is null", i);
+		ObjectField *entry = object_upsert_hashed(NULL, objects[i], k->string, k->hash);
+		if(!entry)
+			continue;
+		Variable *v = entry->value;
+		bool number = v->type == VAR_INTEGER || v->type == VAR_FLOAT || v->type == VAR_BOOLEAN;
+		switch(type)
+		{
+			case VAR_INTEGER:
+			case VAR_BOOLEAN:
+				if(!number)
+					continue;
+				*(int *)data = v->type == VAR_FLOAT ? (int)v->u.fval : (int)v->u.ival;
+				if(type == VAR_BOOLEAN)
+					*(int *)data = *(int *)data != 0;
+				break;
+			case VAR_FLOAT:
+				if(!number)
+					continue;
+				*(float *)data = v->type == VAR_FLOAT ? v->u.fval : (float)v->u.ival;
+				break;
+			case VAR_VECTOR:
+				if(v->type != VAR_VECTOR)
+					continue;
+				memcpy(data, v->u.vval, sizeof(v->u.vval));
+				break;
+		}
+		written++;
+	}
+	return written;
+}
+
 void vm_init(VM *vm, Allocator *allocator, StringTable *strtab, const char *default_self, int max_threads)
 {
 	memset(vm, 0, sizeof(vm));
@@ -1920,29 +2374,79 @@ void vm_init(VM *vm, Allocator *allocator, StringTable *strtab, const char *defa
 	vm->max_threads = max_threads;
 	vm->allocator = allocator;
 	vm->strings = strtab;
+	vm->string_index.timeout = vm_string_index(vm, "timeout");
+	vm->timers = NULL;
+	vm->timer_heap = NULL;
+	vm->timer_count = 0;
+	vm->timer_capacity = 0;
+	vm->free_timer = -1;
+	vm->handles = NULL;
+	vm->handle_count = 0;
+	vm->handle_capacity = 0;
+	vm->free_handle = -1;
+	vm->asyncs = NULL;
+	vm->async_count = 0;
+	vm->async_capacity = 0;
+	vm->free_async = -1;
+	vm->intrinsics = 0;
+	vm->keys = NULL;
+	vm->key_count = 0;
+	vm->key_capacity = 0;
+	hash_trie_init(&vm->key_lookup);
+	vm->native_fields_key = vm_key(vm, "__fields");
+	vm->scratch_threads = NULL;
+	vm->free_thread_count = 0;
+	vm->threads_spawned = 0;
+	vm->batch_spawned = 0;
+	vm->batch_spawn_ms = 0.0;
 	vm->random_state = time(0);
 	vm->frame = 0;
-	vm->thread_buffer = allocator->malloc(allocator->ctx, sizeof(Thread*) * max_threads);
+	vm->threads = NULL;
+	vm->thread_count = 0;
+	vm->thread_id = 0;
+	vm->time = 0.0;
+	vm->frame_started = false;
+	vm->run_index = 0;
+	vm->preempted = NULL;
+	vm->threads_run = 0;
+	vm->threads_deferred = 0;
+	vm->out_of_budget = NULL;
+	vm->instructions = 0;
+	vm_set_budget(vm, 0, 0.0);
+	vm->call_priority = GSC_PRIORITY_NORMAL;
+	memset(vm->priority_stats, 0, sizeof(vm->priority_stats));
+	vm->events = NULL;
+	vm->event_count = 0;
+	vm->event_capacity = 0;
+	vm->wait_lists = NULL;
+	vm->wait_list_count = 0;
+	vm->wait_list_capacity = 0;
 	snprintf(vm->default_self, sizeof(vm->default_self), "%s", default_self);
-	for(int i = 0; i < VM_MAX_EVENTS_PER_FRAME; ++i)
-	{
-		vm->events[i].frame = -1;
-	}
-	if(!uo_init(&vm->pool.uo, (1 << 16), -1, allocator))
-		vm_error(vm, "Failed to initialize union objects");
+	slab_init(&vm->slab, allocator, SLAB_DEFAULT_CHUNK_SIZE);
+	slab_add_class(&vm->slab, "variable", sizeof(Variable), _Alignof(Variable));
+	slab_add_class(&vm->slab, "object_field", sizeof(ObjectField), _Alignof(ObjectField));
+	slab_add_class(&vm->slab, "object", sizeof(Object), _Alignof(Object));
+	slab_add_class(&vm->slab, "string16", 16, 1);
+	slab_add_class(&vm->slab, "string32", 32, 1);
+	slab_add_class(&vm->slab, "string64", 64, 1);
+	slab_add_class(&vm->slab,
+				   "locals",
+				   sizeof(VMLocalsSegment) + sizeof(Variable) * VM_LOCALS_SEGMENT_SIZE,
+				   _Alignof(VMLocalsSegment));
+	slab_add_class(&vm->slab,
+				   "locals_large",
+				   sizeof(VMLocalsSegment) + sizeof(Variable) * VM_MAX_LOCALS,
+				   _Alignof(VMLocalsSegment));
+	slab_add_class(&vm->slab, "wait_list", sizeof(VMWaitList), _Alignof(VMWaitList));
+	slab_add_class(&vm->slab, "subscription", sizeof(VMSubscription), _Alignof(VMSubscription));
 	// variable_init(&vm->pool.variables, (1 << 19), -1, allocator);
 	// object_init(&vm->pool.objects, (1 << 19), -1, allocator);
 	// object_field_init(&vm->pool.object_fields, (1 << 19), -1, allocator);
-	if(!thread_init(&vm->pool.threads, max_threads, -1, allocator))
-		vm_error(vm, "Failed to initialize threads");
-	if(!stack_frame_init(&vm->pool.stack_frames, max_threads * VM_FRAME_SIZE, -1, allocator))
-		vm_error(vm, "Failed to initialize stack frames");
+	vm->free_threads = NULL;
+	vm->thread_total = 0;
+	grow_frames(vm, &vm->temp_thread, 1);
 
-	size_t N = 16384;
-	char *arena_mem = allocator->malloc(allocator->ctx, N);
-	if(!arena_mem)
-		vm_error(vm, "Failed to allocate function memory");
-	arena_init(&vm->c_function_arena, arena_mem, N);
+	arena_init_chained(&vm->c_function_arena, &vm->c_function_arena_info, "function", allocator, 16384, 0);
 
 	// hash_trie_init(&vm->c_functions);
 	// hash_trie_init(&vm->c_methods);
@@ -1983,16 +2487,53 @@ typedef struct
 {
 	void *callback;
 	void *ctx;
+	// Typed functions get their arguments unpacked and the result boxed by the VM
+	bool typed;
+	int argc;
+	char argument_types[VM_MAX_TYPED_ARGUMENTS];
+	char return_type;
 } CallbackFunction;
 
 void vm_register_callback_function(VM *vm, const char *name, void *callback, void *ctx)
 {
 	CallbackFunction *f = vm->allocator->malloc(vm->allocator->ctx, sizeof(CallbackFunction));
+	memset(f, 0, sizeof(CallbackFunction));
 	f->callback = callback;
 	f->ctx = ctx ? ctx : vm;
 	hash_trie_upsert(&vm->callback_functions, name, vm->allocator, false)->value = f;
 }
 
+static bool valid_value_type(char type)
+{
+	return type && strchr("ifvsbo", type) != NULL;
+}
+
+bool vm_register_typed_function(VM *vm, const char *name, const char *signature, gsc_TypedFunction callback, void *ctx)
+{
+	CallbackFunction f = { 0 };
+	f.callback = (void *)callback;
+	f.ctx = ctx ? ctx : vm;
+	f.typed = true;
+	f.return_type = '-';
+	const char *p = signature;
+	for(; *p && *p != '>'; ++p)
+	{
+		if(f.argc >= VM_MAX_TYPED_ARGUMENTS || !valid_value_type(*p))
+			return false;
+		f.argument_types[f.argc++] = *p;
+	}
+	if(*p == '>' && p[1])
+	{
+		if(p[2] || (p[1] != '-' && !valid_value_type(p[1])))
+			return false;
+		f.return_type = p[1];
+	}
+	CallbackFunction *cf = vm->allocator->malloc(vm->allocator->ctx, sizeof(CallbackFunction));
+	*cf = f;
+	hash_trie_upsert(&vm->callback_functions, name, vm->allocator, false)->value = cf;
+	return true;
+}
+
 void vm_register_c_function(VM *vm, const char *name, vm_CFunction callback)
 {
 	vm_register_callback_function(vm, name, (void *)callback, vm);
@@ -2268,6 +2809,154 @@ void vm_pushundefined(VM *vm)
     push(vm, v);
 }
 
+static void call_typed_function(VM *vm, CallbackFunction *cfunc, const char *function, size_t nargs)
+{
+	if(nargs != cfunc->argc)
+	{
+		vm_error(vm, "'%s' takes %d arguments, got %d", function, cfunc->argc, (int)nargs);
+	}
+	gsc_Value args[VM_MAX_TYPED_ARGUMENTS];
+	Variable *argv = &vm->thread->stack[vm->fsp - 3];
+	for(int i = 0; i < cfunc->argc; ++i)
+	{
+		Variable *arg = argv - i;
+		switch(cfunc->argument_types[i])
+		{
+			case 'i': args[i].i = vm_cast_int(vm, arg); break;
+			case 'f': args[i].f = vm_cast_float(vm, arg); break;
+			case 'v': vm_cast_vector(vm, arg, args[i].v); break;
+			case 's': args[i].s = vm_cast_string(vm, arg); break;
+			case 'b': args[i].b = vm_cast_bool(vm, arg); break;
+			case 'o': args[i].o = vm_cast_object(vm, arg); break;
+		}
+	}
+	gsc_Value result;
+	((gsc_TypedFunction)cfunc->callback)(cfunc->ctx, args, &result);
+
+	// Box the result and put it in place of the arguments
+	Variable ret = var(vm);
+	switch(cfunc->return_type)
+	{
+		case 'i': ret.type = VAR_INTEGER; ret.u.ival = result.i; break;
+		case 'f': ret.type = VAR_FLOAT; ret.u.fval = result.f; break;
+		case 'b': ret.type = VAR_BOOLEAN; ret.u.ival = result.b != 0; break;
+		case 'v':
+			ret.type = VAR_VECTOR;
+			memcpy(ret.u.vval, result.v, sizeof(ret.u.vval));
+			break;
+		case 's':
+			if(result.s)
+			{
+				vm_pushstring(vm, result.s);
+				ret = pop(vm);
+			}
+			break;
+		case 'o':
+			if(result.o)
+			{
+				ret.type = VAR_OBJECT;
+				ret.u.oval = result.o;
+			}
+			break;
+	}
+	vm->thread->sp -= nargs + 2;
+	push(vm, ret);
+}
+
+static float vector_dot(const float *a, const float *b)
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static int64_t intrinsic_int(VM *vm, Variable *v)
+{
+	switch(v->type)
+	{
+		case VAR_INTEGER:
+		case VAR_BOOLEAN: return v->u.ival;
+		case VAR_FLOAT: return (int64_t)v->u.fval;
+		case VAR_INTERNED_STRING:
+		case VAR_STRING: return strtoll(variable_string(vm, v), NULL, 10);
+		default: vm_error(vm, "Can't convert '%s' to int", variable_type_names[v->type]);
+	}
+	return 0;
+}
+
+static float intrinsic_float(VM *vm, Variable *v)
+{
+	switch(v->type)
+	{
+		case VAR_INTEGER:
+		case VAR_BOOLEAN: return (float)v->u.ival;
+		case VAR_FLOAT: return v->u.fval;
+		case VAR_INTERNED_STRING:
+		case VAR_STRING: return strtof(variable_string(vm, v), NULL);
+		default: vm_error(vm, "Can't convert '%s' to float", variable_type_names[v->type]);
+	}
+	return 0;
+}
+
+// Builtins compiled to OP_INTRINSIC, the arguments are on the stack with the first one on top
+static void call_intrinsic(VM *vm, Thread *thr, int intrinsic)
+{
+	if(intrinsic < 0 || intrinsic >= INTRINSIC_MAX)
+		vm_error(vm, "Invalid intrinsic %d", intrinsic);
+	Variable *args = &thr->stack[thr->sp - 1];
+	Variable result = var(vm);
+	float a[3], b[3];
+	switch(intrinsic)
+	{
+		case INTRINSIC_ISDEFINED:
+			result.type = VAR_BOOLEAN;
+			result.u.ival = args[0].type != VAR_UNDEFINED;
+			break;
+		case INTRINSIC_INT:
+			result.type = VAR_INTEGER;
+			result.u.ival = intrinsic_int(vm, &args[0]);
+			break;
+		case INTRINSIC_FLOAT:
+			result.type = VAR_FLOAT;
+			result.u.fval = intrinsic_float(vm, &args[0]);
+			break;
+		case INTRINSIC_LENGTH:
+		case INTRINSIC_LENGTHSQUARED:
+			vm_cast_vector(vm, &args[0], a);
+			result.type = VAR_FLOAT;
+			result.u.fval = vector_dot(a, a);
+			if(intrinsic == INTRINSIC_LENGTH)
+				result.u.fval = sqrtf(result.u.fval);
+			break;
+		case INTRINSIC_DISTANCE:
+		case INTRINSIC_DISTANCESQUARED:
+			vm_cast_vector(vm, &args[0], a);
+			vm_cast_vector(vm, &args[-1], b);
+			for(int k = 0; k < 3; ++k)
+				a[k] -= b[k];
+			result.type = VAR_FLOAT;
+			result.u.fval = vector_dot(a, a);
+			if(intrinsic == INTRINSIC_DISTANCE)
+				result.u.fval = sqrtf(result.u.fval);
+			break;
+		case INTRINSIC_VECTORDOT:
+			vm_cast_vector(vm, &args[0], a);
+			vm_cast_vector(vm, &args[-1], b);
+			result.type = VAR_FLOAT;
+			result.u.fval = vector_dot(a, b);
+			break;
+		case INTRINSIC_VECTORNORMALIZE:
+		{
+			vm_cast_vector(vm, &args[0], a);
+			float l = sqrtf(vector_dot(a, a));
+			result.type = VAR_VECTOR;
+			for(int k = 0; k < 3; ++k)
+				result.u.vval[k] = l > 0.f ? a[k] / l : 0.f;
+		}
+		break;
+	}
+	thr->sp -= intrinsics[intrinsic].argc;
+	push(vm, result);
+}
+
 // TODO: make use of namespace
 static void call_c_function(VM *vm, const char *namespace, const char *function, int function_string_index, size_t nargs, int call_flags)
 {
@@ -2278,6 +2967,7 @@ static void call_c_function(VM *vm, const char *namespace, const char *function,
 	// 	vm_error(vm, "Can't call builtin functions threaded");
 	// }
 	Arena rollback = vm->c_function_arena;
+	grow_stack(vm, vm->thread, vm->thread->sp + VM_NATIVE_STACK_RESERVE);
 	int nret;
 	if(!(call_flags & VM_CALL_FLAG_METHOD))
 	{
@@ -2286,6 +2976,12 @@ static void call_c_function(VM *vm, const char *namespace, const char *function,
 		{
 			vm_error(vm, "No builtin function '%s::%s'", namespace, function);
 		}
+		if(cfunc->typed)
+		{
+			call_typed_function(vm, cfunc, function, nargs);
+			vm->c_function_arena = rollback;
+			return;
+		}
 		vm_CFunction fun = (vm_CFunction)cfunc->callback;
 		nret = fun(cfunc->ctx);
 	}
@@ -2314,7 +3010,12 @@ static void call_c_function(VM *vm, const char *namespace, const char *function,
 		}
 		nret = func(vm->ctx);
 	}
-	if(nret == 0)
+	if((nret == GSC_PENDING) != (vm->thread->state == VM_THREAD_WAITING_ASYNC))
+	{
+		vm_error(vm, "'%s' must call gsc_async_begin and return GSC_PENDING to wait", function);
+	}
+	// Async functions get their result when they're completed
+	if(nret == 0 || nret == GSC_PENDING)
 	{
 		push(vm, undef);
 	}
@@ -2381,15 +3082,216 @@ const char *vm_stack_frame_variable_name(VM *vm, StackFrame *sf, int index)
 	return vmf->variable_names[index];
 }
 
-static bool call_function(VM *vm, Thread *thr, const char *file, const char *function, int function_string_index, size_t nargs, bool reversed, int call_flags)
+static Variable *allocate_locals(VM *vm, Thread *thr, StackFrame *sf, int count)
 {
-	// printf("call_function(%s::%s)\n", file, function);
-	CompiledFunction *vmf = vm->func_lookup(vm->ctx, file, function);
-    if(!vmf)
+	VMLocalsSegment *seg = thr->locals;
+	if(!seg || seg->capacity - seg->used < count)
+	{
+		// Segments after the current one are kept around from earlier calls
+		VMLocalsSegment *next = seg ? seg->next : NULL;
+		if(next && next->capacity >= count)
+		{
+			seg = next;
+		}
+		else
+		{
+			int large = count > VM_LOCALS_SEGMENT_SIZE;
+			VMLocalsSegment *n = slab_allocate(&vm->slab, large ? VM_SLAB_LOCALS_LARGE : VM_SLAB_LOCALS);
+			if(!n)
+				vm_error(vm, "No variables left");
+			n->capacity = large ? VM_MAX_LOCALS : VM_LOCALS_SEGMENT_SIZE;
+			n->prev = seg;
+			n->next = next;
+			if(next)
+				next->prev = n;
+			if(seg)
+				seg->next = n;
+			seg = n;
+		}
+		seg->used = 0;
+	}
+	thr->locals = seg;
+	sf->locals_segment = seg;
+	sf->locals = &seg->values[seg->used];
+	seg->used += count;
+	memset(sf->locals, 0, sizeof(Variable) * count);
+	return sf->locals;
+}
+
+static void free_locals(VM *vm, Thread *thr, StackFrame *sf)
+{
+	VMLocalsSegment *seg = sf->locals_segment;
+	if(!seg)
+		return;
+	seg->used = sf->locals - seg->values;
+	// Frames are popped in order, so the caller's block is either in this segment or the previous one
+	thr->locals = seg->used == 0 && seg->prev ? seg->prev : seg;
+	sf->locals = NULL;
+	sf->locals_segment = NULL;
+}
+
+static Thread *allocate_thread(VM *vm)
+{
+	Thread *t = vm->free_threads;
+	if(t)
+	{
+		vm->free_threads = t->next_free;
+		vm->free_thread_count--;
+	}
+	else
+	{
+		if(vm->thread_total >= vm->max_threads)
+			vm_error(vm, "No threads left");
+		t = vm->allocator->malloc(vm->allocator->ctx, sizeof(Thread));
+		if(!t)
+			vm_error(vm, "No threads left");
+		memset(t, 0, sizeof(Thread));
+		vm->thread_total++;
+	}
+	// Recycled threads keep their stacks and locals, only the state is reset
+	t->next_free = NULL;
+	t->state = VM_THREAD_ACTIVE;
+	t->sp = 0;
+	t->bp = 0;
+	t->result = 0;
+	t->wait = 0.f;
+	t->waittill.name = 0;
+	t->waittill.object = NULL;
+	t->waittill.numargs = 0;
+	t->owner = NULL;
+	t->owner_prev = NULL;
+	t->owner_next = NULL;
+	t->instructions = 0;
+	t->priority = GSC_PRIORITY_NORMAL;
+	t->run_priority = GSC_PRIORITY_NORMAL;
+	t->deferred = 0;
+	t->timeout = -1.f;
+	t->return_event = false;
+	t->async = -1;
+	t->caller.file = NULL;
+	t->caller.function = NULL;
+	t->return_value = NULL;
+	t->subscriptions = NULL;
+	t->id = vm->thread_id++;
+	vm->threads_spawned++;
+	t->heap_index = -1;
+	t->queued = false;
+	t->invoking = 0;
+	t->prev = NULL;
+	t->next = vm->threads;
+	if(vm->threads)
+		vm->threads->prev = t;
+	vm->threads = t;
+	vm->thread_count++;
+	grow_frames(vm, t, 1);
+	return t;
+}
+
+static void unsubscribe_thread(VM *vm, Thread *t, int kind);
+
+static void detach_thread(Thread *t)
+{
+	if(!t->owner)
+		return;
+	if(t->owner_prev)
+		t->owner_prev->owner_next = t->owner_next;
+	else
+		t->owner->threads = t->owner_next;
+	if(t->owner_next)
+		t->owner_next->owner_prev = t->owner_prev;
+	t->owner = NULL;
+	t->owner_prev = NULL;
+	t->owner_next = NULL;
+}
+
+// Links the thread to the object it runs on, so it can be killed along with it
+static void attach_thread(Thread *t)
+{
+	if(t->bp < 0 || !t->frames[0].locals || t->frames[0].local_count < 1)
+		return;
+	Variable *self = &t->frames[0].locals[0];
+	if(self->type != VAR_OBJECT)
+		return;
+	Object *o = self->u.oval;
+	t->owner = o;
+	t->owner_prev = NULL;
+	t->owner_next = o->threads;
+	if(o->threads)
+		o->threads->owner_prev = t;
+	o->threads = t;
+}
+
+// Finished threads keep their first locals segment
+static void reset_locals(Thread *t)
+{
+	VMLocalsSegment *seg = t->locals;
+	while(seg && seg->prev)
+		seg = seg->prev;
+	if(seg)
+		seg->used = 0;
+	t->locals = seg;
+}
+
+static void release_async(VM *vm, Thread *t);
+
+static void free_thread(VM *vm, Thread *t)
+{
+	wake_thread(vm, t);
+	release_async(vm, t);
+	unsubscribe_thread(vm, t, -1);
+	detach_thread(t);
+	if(t->prev)
+		t->prev->next = t->next;
+	else
+		vm->threads = t->next;
+	if(t->next)
+		t->next->prev = t->prev;
+	vm->thread_count--;
+	reset_locals(t);
+	t->next_free = vm->free_threads;
+	vm->free_threads = t;
+	vm->free_thread_count++;
+}
+
+// Makes sure count threads can be allocated without going to the allocator for each one
+static void reserve_threads(VM *vm, int count)
+{
+	int n = count - vm->free_thread_count;
+	if(n > vm->max_threads - vm->thread_total)
+		n = vm->max_threads - vm->thread_total;
+	if(n <= 0)
+		return;
+	Thread *block = vm->allocator->malloc(vm->allocator->ctx, sizeof(Thread) * n);
+	if(!block)
+		return;
+	memset(block, 0, sizeof(Thread) * n);
+	for(int i = n - 1; i >= 0; --i)
+	{
+		block[i].next_free = vm->free_threads;
+		vm->free_threads = &block[i];
+	}
+	vm->free_thread_count += n;
+	vm->thread_total += n;
+}
+
+static void enter_function(VM *vm, Thread *thr, CompiledFunction *vmf, const char *file, const char *function, size_t nargs, bool reversed);
+
+static bool call_function(VM *vm, Thread *thr, const char *file, const char *function, int function_string_index, size_t nargs, bool reversed, int call_flags)
+{
+	// printf("call_function(%s::%s)\n", file, function);
+	CompiledFunction *vmf = vm->func_lookup(vm->ctx, file, function);
+    if(!vmf)
     {
 		call_c_function(vm, file, function, function_string_index, nargs, call_flags);
         return false;
 	}
+	enter_function(vm, thr, vmf, file, function, nargs, reversed);
+	return true;
+}
+
+// Sets up the frame at bp, the arguments, self and nargs are on top of the stack of the thread
+static void enter_function(VM *vm, Thread *thr, CompiledFunction *vmf, const char *file, const char *function, size_t nargs, bool reversed)
+{
 	// Object *prev_self = object_for_var(&vm->globals[VAR_GLOB_LEVEL]);
 	// if(thr->bp != 0)
 	// {
@@ -2406,18 +3308,7 @@ static bool call_function(VM *vm, Thread *thr, const char *file, const char *fun
 	// sf->local_count = vmf->local_count;
 	// sf->locals = new(&vm->arena, Variable, vmf->local_count);
 	sf->local_count = vmf->local_count;
-	for(size_t i = 0; i < vmf->local_count; ++i)
-	{
-		Variable *v = object_pool_allocate(&vm->pool.uo, Variable);
-		if(!v)
-			vm_error(vm, "No variables left");
-		v->type = VAR_UNDEFINED;
-		v->u.ival = 0;
-		sf->locals[i] = v;
-		// buf_push(sf->locals, (Variable) { 0 });
-		// sf->locals[i].type = VAR_UNDEFINED;
-		// sf->locals[i].u.ival = 0;
-	}
+	allocate_locals(vm, thr, sf, vmf->local_count);
 	pop_thread(vm, thr); //nargs
 	// + 1 for implicit self parameter
 	for(size_t i = 0; i < nargs + 1; ++i)
@@ -2427,7 +3318,7 @@ static bool call_function(VM *vm, Thread *thr, const char *file, const char *fun
 		if(i < vmf->parameter_count + 1)
 		{
 			size_t local_idx = reversed ? (nargs + 1) - i - 1 : i;
-			*sf->locals[local_idx] = arg;
+			sf->locals[local_idx] = arg;
 		}
 	}
 	sf->file = file;
@@ -2442,18 +3333,24 @@ static bool call_function(VM *vm, Thread *thr, const char *file, const char *fun
 	// 	print_instruction(vm, &vmf->instructions[i], fp);
 	// fclose(fp);
 	// getchar();
-	return true;
+}
+
+// Arguments are taken from the top of the stack of the calling thread, pushed in order
+static void move_arguments(VM *vm, Thread *from, Thread *to, size_t nargs)
+{
+	if(from->sp < (int)nargs)
+		vm_error(vm, "Expected %d arguments on the stack", (int)nargs);
+	for(size_t i = 0; i < nargs; ++i)
+		push_thread(vm, to, from->stack[from->sp - 1 - i]);
+	from->sp -= nargs;
 }
 
 bool vm_call_function_thread(VM *vm, const char *file, const char *function, size_t nargs, Variable *self)
 {
-	vm->thread = object_pool_allocate(&vm->pool.threads, Thread);
-	if(!vm->thread)
-		vm_error(vm, "No threads left");
-	memset(vm->thread, 0, sizeof(Thread));
-	vm->thread->bp = 0;
-	vm->thread->return_value = NULL;
-	vm->thread->state = VM_THREAD_ACTIVE;
+	Thread *caller = vm->thread;
+	vm->thread = allocate_thread(vm);
+	vm->thread->priority = vm->call_priority;
+	move_arguments(vm, caller, vm->thread, nargs);
 	// push_thread(vm, vm->thread, self ? *self : vm->globals[VAR_GLOB_LEVEL]);
 	if(self)
 	{
@@ -2467,11 +3364,122 @@ bool vm_call_function_thread(VM *vm, const char *file, const char *function, siz
 	if(self && self->type != VAR_OBJECT)
 		vm_error(vm, "'%s' is not an object", variable_type_names[self->type]);
 	bool result = call_function(vm, vm->thread, file, function, vm_string_index(vm, function), nargs, false, 0);
+	if(result)
+		attach_thread(vm->thread);
 	add_thread(vm, vm->thread);
 	vm->thread = &vm->temp_thread;
 	return result;
 }
 
+// Starts a thread of the function for every object, push_arguments pushes the arguments for each one in order
+void vm_spawn_threads(VM *vm, CompiledFunction *vmf, Object **objects, int count, int nargs, void (*push_arguments)(void *ctx, int index, void *userdata), void *userdata)
+{
+	if(count <= 0)
+		return;
+	reserve_threads(vm, count);
+	thread_list_reserve(vm, &vm->activated, vm->activated.count + count);
+	Thread *caller = vm->thread;
+	for(int i = 0; i < count; ++i)
+	{
+		Thread *t = allocate_thread(vm);
+		t->priority = vm->call_priority;
+		if(push_arguments)
+		{
+			int sp = caller->sp;
+			push_arguments(vm->ctx, i, userdata);
+			if(caller->sp - sp != nargs)
+				vm_error(vm, "Expected %d arguments to be pushed, got %d", nargs, caller->sp - sp);
+			move_arguments(vm, caller, t, nargs);
+		}
+		else
+		{
+			for(int k = 0; k < nargs; ++k)
+				push_thread(vm, t, undef);
+		}
+		Variable self = var(vm);
+		self.type = VAR_OBJECT;
+		self.u.oval = objects[i];
+		push_thread(vm, t, self);
+		push_thread(vm, t, integer(vm, nargs));
+		enter_function(vm, t, vmf, vmf->file->name, vmf->name, nargs, false);
+		attach_thread(t);
+		add_thread(vm, t);
+	}
+}
+
+static Thread *allocate_scratch_thread(VM *vm)
+{
+	Thread *t = vm->scratch_threads;
+	if(t)
+	{
+		vm->scratch_threads = t->next_free;
+	}
+	else
+	{
+		t = vm->allocator->malloc(vm->allocator->ctx, sizeof(Thread));
+		if(!t)
+			vm_error(vm, "Failed to allocate thread");
+		memset(t, 0, sizeof(Thread));
+		t->heap_index = -1;
+		t->timeout = -1.f;
+		grow_frames(vm, t, 1);
+	}
+	t->next_free = NULL;
+	t->state = VM_THREAD_ACTIVE;
+	t->sp = 0;
+	t->bp = 0;
+	t->result = 0;
+	t->priority = vm->thread == &vm->temp_thread ? vm->call_priority : vm->thread->priority;
+	return t;
+}
+
+// Runs a script function to completion on a scratch thread, which isn't scheduled and can't wait.
+// The result replaces the arguments on the stack of the calling thread, calls can be nested
+void vm_invoke(VM *vm, CompiledFunction *vmf, size_t nargs, Variable *self)
+{
+	Thread *caller = vm->thread;
+	Thread *t = allocate_scratch_thread(vm);
+	caller->invoking++;
+	move_arguments(vm, caller, t, nargs);
+	if(self)
+	{
+		if(self->type != VAR_OBJECT)
+			vm_error(vm, "'%s' is not an object", variable_type_names[self->type]);
+		push_thread(vm, t, *self);
+	}
+	else
+	{
+		vm->thread = t;
+		gsc_get_global(vm->ctx, vm->default_self);
+	}
+	push_thread(vm, t, integer(vm, nargs));
+	Variable result = undef;
+	t->return_value = &result;
+	enter_function(vm, t, vmf, vmf->file->name, vmf->name, nargs, false);
+
+	vm->thread = t;
+	while(t->state == VM_THREAD_ACTIVE)
+	{
+		StackFrame *sf = stack_frame(vm, t);
+		if(sf->ip >= sf->instruction_count)
+			vm_error(vm, "ip oob %d/%d", sf->ip, sf->instruction_count);
+		if(!vm_execute_instruction(vm, &sf->instructions[sf->ip++]))
+			break;
+		vm->instructions++;
+	}
+	if(t->state != VM_THREAD_INACTIVE)
+		vm_error(vm, "'%s' can't wait when it's invoked", vmf->name);
+	vm->thread = caller;
+	caller->invoking--;
+
+	unsubscribe_thread(vm, t, -1);
+	reset_locals(t);
+	t->return_value = NULL;
+	t->next_free = vm->scratch_threads;
+	vm->scratch_threads = t;
+	push(vm, result);
+}
+
 static bool variable_eq(Variable *a, Variable *b)
 {
 	if(a->type != b->type)
@@ -2484,179 +3492,886 @@ static bool variable_eq(Variable *a, Variable *b)
 	return !memcmp(&a->u, &b->u, sizeof(a->u));
 }
 
-static VMEvent *get_free_event(VM *vm)
+// Makes room for count more events so batches don't grow the queue one doubling at a time
+void vm_reserve_events(VM *vm, int count)
 {
-	for(int i = 0; i < VM_MAX_EVENTS_PER_FRAME; ++i)
+	if(vm->event_count + count > vm->event_capacity)
 	{
-		if(vm->events[i].frame == -1)
-			return &vm->events[i];
+		int n = vm->event_capacity ? vm->event_capacity * 2 : VM_INITIAL_EVENT_COUNT;
+		while(n < vm->event_count + count)
+			n *= 2;
+		VMEvent *events = vm->allocator->malloc(vm->allocator->ctx, sizeof(VMEvent) * n);
+		if(!events)
+			vm_error(vm, "Failed to allocate events");
+		if(vm->event_count > 0)
+			memcpy(events, vm->events, sizeof(VMEvent) * vm->event_count);
+		if(vm->events)
+			vm->allocator->free(vm->allocator->ctx, vm->events);
+		vm->events = events;
+		vm->event_capacity = n;
 	}
-	vm_error(vm, "No free events");
-	return NULL;
 }
 
-static void free_event(VMEvent *ev)
+static VMEvent *push_event(VM *vm)
 {
-	ev->frame = -1;
+	vm_reserve_events(vm, 1);
+	return &vm->events[vm->event_count++];
 }
 
-void vm_notify(VM *vm, Object *object, const char *key, size_t nargs)
+static uint64_t wait_list_hash(Object *object, int name)
 {
-	// TODO: args
+	uint64_t h = (uint64_t)(uintptr_t)object ^ ((uint64_t)(uint32_t)name << 32);
+	h ^= h >> 33;
+	h *= 1111111111111111111u;
+	h ^= h >> 29;
+	return h;
+}
 
-	int name = vm_string_index(vm, key);
-	if(name == -1)
+static VMWaitList **wait_list_slot(VM *vm, Object *object, int name)
+{
+	VMWaitList **it = &vm->wait_lists[wait_list_hash(object, name) & (vm->wait_list_capacity - 1)];
+	while(*it && ((*it)->object != object || (*it)->name != name))
+		it = &(*it)->next;
+	return it;
+}
+
+static VMWaitList *find_wait_list(VM *vm, Object *object, int name)
+{
+	if(vm->wait_list_count == 0)
+		return NULL;
+	return *wait_list_slot(vm, object, name);
+}
+
+static void grow_wait_lists(VM *vm)
+{
+	int n = vm->wait_list_capacity ? vm->wait_list_capacity * 2 : VM_INITIAL_WAIT_LIST_COUNT;
+	VMWaitList **buckets = vm->allocator->malloc(vm->allocator->ctx, sizeof(VMWaitList *) * n);
+	if(!buckets)
+		vm_error(vm, "Failed to allocate wait lists");
+	memset(buckets, 0, sizeof(VMWaitList *) * n);
+	for(int i = 0; i < vm->wait_list_capacity; ++i)
 	{
-		vm_error(vm, "Can't find string '%s'", key);
+		for(VMWaitList *it = vm->wait_lists[i], *next; it; it = next)
+		{
+			next = it->next;
+			VMWaitList **bucket = &buckets[wait_list_hash(it->object, it->name) & (n - 1)];
+			it->next = *bucket;
+			*bucket = it;
+		}
+	}
+	if(vm->wait_lists)
+		vm->allocator->free(vm->allocator->ctx, vm->wait_lists);
+	vm->wait_lists = buckets;
+	vm->wait_list_capacity = n;
+}
+
+static VMSubscription *subscribe(VM *vm, Object *object, int name, VMSubscriptionKind kind)
+{
+	if(vm->wait_list_count >= vm->wait_list_capacity)
+		grow_wait_lists(vm);
+	VMWaitList **slot = wait_list_slot(vm, object, name);
+	VMWaitList *list = *slot;
+	if(!list)
+	{
+		list = slab_allocate(&vm->slab, VM_SLAB_WAIT_LIST);
+		if(!list)
+			vm_error(vm, "No wait lists left");
+		memset(list, 0, sizeof(VMWaitList));
+		list->object = object;
+		list->name = name;
+		*slot = list;
+		vm->wait_list_count++;
+	}
+	VMSubscription *sub = slab_allocate(&vm->slab, VM_SLAB_SUBSCRIPTION);
+	if(!sub)
+		vm_error(vm, "No subscriptions left");
+	sub->list = list;
+	sub->kind = kind;
+	sub->prev = NULL;
+	sub->next = list->head[kind];
+	if(sub->next)
+		sub->next->prev = sub;
+	list->head[kind] = sub;
+	sub->thread_next = NULL;
+	return sub;
+}
+
+void vm_subscribe(VM *vm, Thread *thr, Object *object, int name, VMSubscriptionKind kind)
+{
+	VMSubscription *sub = subscribe(vm, object, name, kind);
+	sub->thread = thr;
+	sub->thread_next = thr->subscriptions;
+	thr->subscriptions = sub;
+}
+
+// Waits for any of the events the thread subscribed to with VM_SUBSCRIPTION_WAITTILL, the name of the one that
+// wakes it up is returned to the script, or "timeout" if none came in time
+void vm_wait_any(VM *vm, Thread *thr, float timeout)
+{
+	thr->state = VM_THREAD_WAITING_EVENT;
+	thr->waittill.numargs = 0;
+	thr->timeout = timeout;
+	thr->return_event = true;
+}
+
+static void set_wait_result(VM *vm, Thread *t, int name)
+{
+	if(t->return_event)
+	{
+		Variable *result = &t->stack[t->sp - 1];
+		result->type = VAR_INTERNED_STRING;
+		result->u.ival = name;
+	}
+	t->timeout = -1.f;
+	t->return_event = false;
+}
+
+static void unsubscribe(VM *vm, VMSubscription *sub)
+{
+	VMWaitList *list = sub->list;
+	if(sub->prev)
+		sub->prev->next = sub->next;
+	else
+		list->head[sub->kind] = sub->next;
+	if(sub->next)
+		sub->next->prev = sub->prev;
+	slab_deallocate(&vm->slab, VM_SLAB_SUBSCRIPTION, sub);
+	for(int i = 0; i < VM_SUBSCRIPTION_MAX; ++i)
+	{
+		if(list->head[i])
+			return;
+	}
+	*wait_list_slot(vm, list->object, list->name) = list->next;
+	vm->wait_list_count--;
+	slab_deallocate(&vm->slab, VM_SLAB_WAIT_LIST, list);
+}
+
+// kind -1 removes all subscriptions of the thread
+static void unsubscribe_thread(VM *vm, Thread *t, int kind)
+{
+	VMSubscription **it = &t->subscriptions;
+	while(*it)
+	{
+		VMSubscription *sub = *it;
+		if(kind != -1 && sub->kind != kind)
+		{
+			it = &sub->thread_next;
+			continue;
+		}
+		*it = sub->thread_next;
+		unsubscribe(vm, sub);
+	}
+}
+
+static bool timer_due_before(VM *vm, int a, int b)
+{
+	return vm->timers[a].due < vm->timers[b].due;
+}
+
+static void timer_swap(VM *vm, int i, int j)
+{
+	int t = vm->timer_heap[i];
+	vm->timer_heap[i] = vm->timer_heap[j];
+	vm->timer_heap[j] = t;
+	vm->timers[vm->timer_heap[i]].heap_index = i;
+	vm->timers[vm->timer_heap[j]].heap_index = j;
+}
+
+static void timer_sift_up(VM *vm, int i)
+{
+	while(i > 0)
+	{
+		int parent = (i - 1) / 2;
+		if(!timer_due_before(vm, vm->timer_heap[i], vm->timer_heap[parent]))
+			break;
+		timer_swap(vm, i, parent);
+		i = parent;
+	}
+}
+
+static void timer_sift_down(VM *vm, int i)
+{
+	for(;;)
+	{
+		int smallest = i;
+		int l = i * 2 + 1;
+		int r = l + 1;
+		if(l < vm->timer_count && timer_due_before(vm, vm->timer_heap[l], vm->timer_heap[smallest]))
+			smallest = l;
+		if(r < vm->timer_count && timer_due_before(vm, vm->timer_heap[r], vm->timer_heap[smallest]))
+			smallest = r;
+		if(smallest == i)
+			break;
+		timer_swap(vm, i, smallest);
+		i = smallest;
+	}
+}
+
+static void grow_timers(VM *vm)
+{
+	int n = vm->timer_capacity ? vm->timer_capacity * 2 : VM_INITIAL_TIMER_COUNT;
+	VMTimer *timers = vm->allocator->malloc(vm->allocator->ctx, sizeof(VMTimer) * n);
+	int *heap = vm->allocator->malloc(vm->allocator->ctx, sizeof(int) * n);
+	if(!timers || !heap)
+		vm_error(vm, "Failed to allocate timers");
+	if(vm->timer_capacity > 0)
+	{
+		memcpy(timers, vm->timers, sizeof(VMTimer) * vm->timer_capacity);
+		memcpy(heap, vm->timer_heap, sizeof(int) * vm->timer_count);
+		vm->allocator->free(vm->allocator->ctx, vm->timers);
+		vm->allocator->free(vm->allocator->ctx, vm->timer_heap);
+	}
+	for(int i = n - 1; i >= vm->timer_capacity; --i)
+	{
+		timers[i].generation = 0;
+		timers[i].heap_index = -1;
+		timers[i].next_free = vm->free_timer;
+		vm->free_timer = i;
+	}
+	vm->timers = timers;
+	vm->timer_heap = heap;
+	vm->timer_capacity = n;
+}
+
+static void remove_timer(VM *vm, int index)
+{
+	VMTimer *timer = &vm->timers[index];
+	int i = timer->heap_index;
+	int last = --vm->timer_count;
+	if(i != last)
+	{
+		vm->timer_heap[i] = vm->timer_heap[last];
+		vm->timers[vm->timer_heap[i]].heap_index = i;
+		timer_sift_down(vm, i);
+		timer_sift_up(vm, i);
+	}
+	if(timer->endon)
+		unsubscribe(vm, timer->endon);
+	timer->object->timer_count--;
+	timer->endon = NULL;
+	timer->object = NULL;
+	timer->heap_index = -1;
+	timer->next_free = vm->free_timer;
+	vm->free_timer = index;
+}
+
+// Returns an id to cancel the timer with, endon is the name of an event on the object that cancels it or -1
+int64_t vm_add_timer(VM *vm, Object *object, int name, float delay, float period, int endon)
+{
+	if(period < 0.f)
+		vm_error(vm, "Timer period must not be negative");
+	if(vm->free_timer == -1)
+		grow_timers(vm);
+	int index = vm->free_timer;
+	VMTimer *timer = &vm->timers[index];
+	vm->free_timer = timer->next_free;
+	timer->generation++;
+	timer->due = vm->time + (delay > 0.f ? delay : 0.f);
+	timer->period = period;
+	timer->object = object;
+	timer->name = name;
+	timer->endon = NULL;
+	timer->heap_index = vm->timer_count;
+	vm->timer_heap[vm->timer_count++] = index;
+	timer_sift_up(vm, timer->heap_index);
+	object->timer_count++;
+	if(endon != -1)
+	{
+		timer->endon = subscribe(vm, object, endon, VM_SUBSCRIPTION_TIMER);
+		timer->endon->timer = index;
+	}
+	return ((int64_t)timer->generation << 32) | (uint32_t)index;
+}
+
+bool vm_cancel_timer(VM *vm, int64_t id)
+{
+	int index = (int)(id & 0xffffffff);
+	if(index < 0 || index >= vm->timer_capacity)
+		return false;
+	VMTimer *timer = &vm->timers[index];
+	if(timer->heap_index == -1 || timer->generation != (uint32_t)(id >> 32))
+		return false;
+	remove_timer(vm, index);
+	return true;
+}
+
+static void grow_handles(VM *vm)
+{
+	int n = vm->handle_capacity ? vm->handle_capacity * 2 : VM_INITIAL_HANDLE_COUNT;
+	VMHandle *handles = vm->allocator->malloc(vm->allocator->ctx, sizeof(VMHandle) * n);
+	if(!handles)
+		vm_error(vm, "Failed to allocate handles");
+	if(vm->handle_capacity > 0)
+	{
+		memcpy(handles, vm->handles, sizeof(VMHandle) * vm->handle_capacity);
+		vm->allocator->free(vm->allocator->ctx, vm->handles);
+	}
+	for(int i = n - 1; i >= vm->handle_capacity; --i)
+	{
+		handles[i].object = NULL;
+		handles[i].refcount = 0;
+		handles[i].generation = 0;
+		handles[i].next_free = vm->free_handle;
+		vm->free_handle = i;
+	}
+	vm->handles = handles;
+	vm->handle_capacity = n;
+}
+
+// Same id layout as timers, the generation starts at 1 so 0 is never a valid handle
+int64_t vm_create_handle(VM *vm, Object *object)
+{
+	if(!object)
+		vm_error(vm, "Can't create a handle without an object");
+	if(vm->free_handle == -1)
+		grow_handles(vm);
+	int index = vm->free_handle;
+	VMHandle *h = &vm->handles[index];
+	vm->free_handle = h->next_free;
+	h->generation++;
+	h->object = object;
+	h->refcount = 1;
+	vm->handle_count++;
+	Variable v = { .type = VAR_OBJECT };
+	v.u.oval = object;
+	incref(vm, &v);
+	return ((int64_t)h->generation << 32) | (uint32_t)index;
+}
+
+static VMHandle *find_handle(VM *vm, int64_t id)
+{
+	int index = (int)(id & 0xffffffff);
+	if(index < 0 || index >= vm->handle_capacity)
+		return NULL;
+	VMHandle *h = &vm->handles[index];
+	if(!h->object || h->generation != (uint32_t)(id >> 32))
+		return NULL;
+	return h;
+}
+
+// NULL if the handle was released
+Object *vm_handle_object(VM *vm, int64_t id)
+{
+	VMHandle *h = find_handle(vm, id);
+	return h ? h->object : NULL;
+}
+
+bool vm_retain_handle(VM *vm, int64_t id)
+{
+	VMHandle *h = find_handle(vm, id);
+	if(!h)
+		return false;
+	h->refcount++;
+	return true;
+}
+
+bool vm_release_handle(VM *vm, int64_t id)
+{
+	VMHandle *h = find_handle(vm, id);
+	if(!h)
+		return false;
+	if(--h->refcount > 0)
+		return true;
+	Variable v = { .type = VAR_OBJECT };
+	v.u.oval = h->object;
+	decref(vm, &v);
+	h->object = NULL;
+	h->next_free = vm->free_handle;
+	vm->free_handle = (int)(id & 0xffffffff);
+	vm->handle_count--;
+	return true;
+}
+
+static void grow_asyncs(VM *vm)
+{
+	int n = vm->async_capacity ? vm->async_capacity * 2 : VM_INITIAL_ASYNC_COUNT;
+	VMAsync *asyncs = vm->allocator->malloc(vm->allocator->ctx, sizeof(VMAsync) * n);
+	if(!asyncs)
+		vm_error(vm, "Failed to allocate async tokens");
+	if(vm->async_capacity > 0)
+	{
+		memcpy(asyncs, vm->asyncs, sizeof(VMAsync) * vm->async_capacity);
+		vm->allocator->free(vm->allocator->ctx, vm->asyncs);
+	}
+	for(int i = n - 1; i >= vm->async_capacity; --i)
+	{
+		asyncs[i].thread = NULL;
+		asyncs[i].generation = 0;
+		asyncs[i].next_free = vm->free_async;
+		vm->free_async = i;
+	}
+	vm->asyncs = asyncs;
+	vm->async_capacity = n;
+}
+
+// Parks the running thread once the native function that called this returns, same id layout as handles
+int64_t vm_async_begin(VM *vm)
+{
+	Thread *thr = vm->thread;
+	if(thr == &vm->temp_thread)
+		vm_error(vm, "Async functions can only be called from a script thread");
+	if(thr->async != -1)
+		vm_error(vm, "Thread is already waiting for an async function");
+	if(vm->free_async == -1)
+		grow_asyncs(vm);
+	int index = vm->free_async;
+	VMAsync *a = &vm->asyncs[index];
+	vm->free_async = a->next_free;
+	a->generation++;
+	a->thread = thr;
+	vm->async_count++;
+	thr->async = index;
+	thr->state = VM_THREAD_WAITING_ASYNC;
+	return ((int64_t)a->generation << 32) | (uint32_t)index;
+}
+
+// Threads that are killed while they wait give up their token, completing it later does nothing
+static void release_async(VM *vm, Thread *t)
+{
+	if(t->async == -1)
+		return;
+	VMAsync *a = &vm->asyncs[t->async];
+	a->thread = NULL;
+	a->next_free = vm->free_async;
+	vm->free_async = t->async;
+	vm->async_count--;
+	t->async = -1;
+}
+
+// The result replaces the undefined the native function left as its return value, the thread runs next frame
+bool vm_async_complete(VM *vm, int64_t token, Variable *result)
+{
+	int index = (int)(token & 0xffffffff);
+	if(index < 0 || index >= vm->async_capacity)
+		return false;
+	VMAsync *a = &vm->asyncs[index];
+	if(!a->thread || a->generation != (uint32_t)(token >> 32))
+		return false;
+	Thread *t = a->thread;
+	release_async(vm, t);
+	if(t->state != VM_THREAD_WAITING_ASYNC)
+		return false;
+	t->stack[t->sp - 1] = *result;
+	t->state = VM_THREAD_ACTIVE;
+	add_thread(vm, t);
+	return true;
+}
+
+static void cancel_object_timers(VM *vm, Object *o)
+{
+	for(int i = 0; i < vm->timer_capacity && o->timer_count > 0; ++i)
+	{
+		if(vm->timers[i].heap_index != -1 && vm->timers[i].object == o)
+			remove_timer(vm, i);
 	}
-	printf("Notifying '%s'\n", key);
-	VMEvent *ev = get_free_event(vm);
+}
+
+// Timers that are due are notified as if it happened last frame, so they're delivered this frame
+static void fire_timers(VM *vm)
+{
+	while(vm->timer_count > 0)
+	{
+		int index = vm->timer_heap[0];
+		VMTimer *timer = &vm->timers[index];
+		if(timer->due > vm->time + 1e-6)
+			break;
+		VMEvent *ev = push_event(vm);
+		ev->object = timer->object;
+		ev->name = timer->name;
+		ev->numargs = 0;
+		ev->frame = vm->frame - 1;
+		if(timer->period <= 0.f)
+		{
+			remove_timer(vm, index);
+			continue;
+		}
+		// Periods shorter than a frame notify once per frame
+		timer->due += timer->period;
+		if(timer->due <= vm->time + 1e-6)
+			timer->due = vm->time + timer->period;
+		timer_sift_down(vm, 0);
+	}
+}
+
+// The arguments are read downwards from args, the way they're laid out on the stack
+void vm_notify_event(VM *vm, Object *object, int name, Variable *args, int numargs)
+{
+	VMEvent *ev = push_event(vm);
 	ev->object = object;
 	ev->name = name;
-	for(int i = 1; i < nargs; i++)
+	if(numargs > VM_MAX_EVENT_ARGS)
+		numargs = VM_MAX_EVENT_ARGS;
+	for(int i = 0; i < numargs; i++)
 	{
-		ev->arguments[i - 1] = *vm_argv(vm, i);
+		ev->arguments[i] = args[-i];
 	}
-	ev->numargs = nargs - 1;
+	ev->numargs = numargs;
 	ev->frame = vm->frame;
-	// VMEvent ev = { .object = object, .name = name, .arguments = NULL };
-	// if(vm->event_count >= VM_MAX_EVENTS_PER_FRAME)
-	// 	vm_error(vm, "event_count >= VM_MAX_EVENTS_PER_FRAME");
-	// vm->events[vm->event_count++] = ev;
-	// buf_push(vm->events, ev);
+}
+
+void vm_notify(VM *vm, Object *object, const char *key, size_t nargs)
+{
+	int name = vm_string_index(vm, key);
+	if(name == -1)
+	{
+		vm_error(vm, "Can't find string '%s'", key);
+	}
+	vm_notify_event(vm, object, name, vm_argv(vm, 1), nargs > 0 ? nargs - 1 : 0);
+}
+
+// Suspends the thread until the event, args are the references that receive the event arguments
+void vm_waittill(VM *vm, Thread *thr, Object *object, int name, Variable *args, int numargs)
+{
+	if(numargs > VM_MAX_EVENT_ARGS)
+		vm_error(vm, "Too many arguments for waittill");
+	for(int i = 0; i < numargs; i++)
+	{
+		if(args[-i].type != VAR_REFERENCE)
+		{
+			vm_error(vm, "Expected reference for waittill");
+		}
+		thr->waittill.arguments[i] = args[-i];
+	}
+	thr->state = VM_THREAD_WAITING_EVENT;
+	thr->waittill.numargs = numargs;
+	thr->waittill.name = name;
+	thr->waittill.object = object;
+	vm_subscribe(vm, thr, object, name, VM_SUBSCRIPTION_WAITTILL);
+}
+
+double vm_clock_ms(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+// How many instructions run in between looking at the clock
+#define VM_DEADLINE_CHECK_INTERVAL (1024)
+
+// 0 for no limit
+void vm_set_budget(VM *vm, int64_t max_instructions, double max_time_ms)
+{
+	vm->instruction_budget_end = max_instructions > 0 ? vm->instructions + max_instructions : INT64_MAX;
+	vm->deadline = max_time_ms > 0.0 ? vm_clock_ms() + max_time_ms : 0.0;
+	vm->instruction_limit = vm->instruction_budget_end;
+	if(vm->deadline > 0.0 && vm->instructions + VM_DEADLINE_CHECK_INTERVAL < vm->instruction_limit)
+		vm->instruction_limit = vm->instructions + VM_DEADLINE_CHECK_INTERVAL;
+}
+
+static bool budget_exhausted(VM *vm)
+{
+	if(vm->instructions >= vm->instruction_budget_end)
+		return true;
+	if(vm->deadline > 0.0)
+	{
+		if(vm_clock_ms() >= vm->deadline)
+			return true;
+		vm->instruction_limit = vm->instructions + VM_DEADLINE_CHECK_INTERVAL;
+		if(vm->instruction_limit > vm->instruction_budget_end)
+			vm->instruction_limit = vm->instruction_budget_end;
+		return false;
+	}
+	vm->instruction_limit = vm->instruction_budget_end;
+	return false;
 }
 
 static void run_thread(VM *vm)
 {
-	while(vm->thread->state == VM_THREAD_ACTIVE)
+	Thread *thr = vm->thread;
+	while(thr->state == VM_THREAD_ACTIVE)
     {
-		StackFrame *sf = stack_frame(vm, vm->thread);
+		StackFrame *sf = stack_frame(vm, thr);
 		if(sf->ip >= sf->instruction_count)
 		{
 			vm_error(vm, "ip oob %d/%d", sf->ip, sf->instruction_count);
 		}
+		int ip = sf->ip;
+		int bp = thr->bp;
 	    Instruction *current = &sf->instructions[sf->ip++];
 		if(!vm_execute_instruction(vm, current))
 		{
 			break;
 		}
+		thr->instructions++;
+		// Only stop at backward jumps, calls and returns, so loops without a wait can't hang the frame
+		if(++vm->instructions >= vm->instruction_limit && thr->state == VM_THREAD_ACTIVE &&
+		   (thr->bp != bp || thr->frames[bp].ip <= ip) && budget_exhausted(vm))
+		{
+			vm->preempted = thr;
+			break;
+		}
     }
 }
 
-bool vm_run_threads(VM *vm, float dt)
+static int compare_thread_priority(const void *a, const void *b)
+{
+	Thread *x = *(Thread **)a;
+	Thread *y = *(Thread **)b;
+	if(x->run_priority != y->run_priority)
+		return x->run_priority < y->run_priority ? -1 : 1;
+	// Promoted threads go after the ones that are in the class by themselves
+	if(x->priority != y->priority)
+		return x->priority < y->priority ? -1 : 1;
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static void kill_thread(VM *vm, Thread *t)
 {
-	int N = thread_count(vm);
-	for(int i = 0; i < N; ++i)
+	if(t->state == VM_THREAD_INACTIVE)
+		return;
+	t->state = VM_THREAD_INACTIVE;
+	// Threads in one of the run lists, the one that's running and the ones suspended in vm_invoke are freed later
+	if(!t->queued && t != vm->thread && !t->invoking)
 	{
-		Thread *t = remove_thread(vm);
-		if(!t)
-			break;
-		StackFrame *sf = NULL;
-		if(t->bp >= 0)
-			sf = &t->frames[t->bp];
-		// printf("Processing thread %s::%s (%s)\n", sf ? sf->file : "?", sf ? sf->function : "?", vm_thread_state_names[t->state]);
-		// getchar();
-		// for(size_t j = 0; j < vm->event_count; j++)
-		for(size_t j = 0; j < VM_MAX_EVENTS_PER_FRAME; j++)
+		free_thread(vm, t);
+		return;
+	}
+	wake_thread(vm, t);
+	unsubscribe_thread(vm, t, -1);
+	detach_thread(t);
+}
+
+void vm_kill_object_threads(VM *vm, Object *object)
+{
+	while(object->threads)
+		kill_thread(vm, object->threads);
+}
+
+static void end_threads(VM *vm, VMEvent *ev)
+{
+	VMWaitList *list;
+	// Killing a thread drops its subscriptions, which can free the list
+	while((list = find_wait_list(vm, ev->object, ev->name)) && list->head[VM_SUBSCRIPTION_ENDON])
+	{
+		kill_thread(vm, list->head[VM_SUBSCRIPTION_ENDON]->thread);
+	}
+	while((list = find_wait_list(vm, ev->object, ev->name)) && list->head[VM_SUBSCRIPTION_TIMER])
+	{
+		remove_timer(vm, list->head[VM_SUBSCRIPTION_TIMER]->timer);
+	}
+}
+
+static void wake_waiters(VM *vm, VMEvent *ev)
+{
+	VMWaitList *list;
+	// Waking a thread drops its subscriptions, which can free the list
+	while((list = find_wait_list(vm, ev->object, ev->name)) && list->head[VM_SUBSCRIPTION_WAITTILL])
+	{
+		Thread *t = list->head[VM_SUBSCRIPTION_WAITTILL]->thread;
+		int min = t->waittill.numargs;
+		if(ev->numargs < min)
+			min = ev->numargs;
+		for(int k = 0; k < min; k++)
 		{
-			VMEvent *ev = &vm->events[j];
-			if(ev->frame == -1 || ev->frame == vm->frame)
-				continue;
-			for(size_t k = 0; k < t->endon_string_count; ++k)
-			{
-				if(ev->name == t->endon[k])
-				{
-					t->state = VM_THREAD_INACTIVE;
-					// printf("Thread %d killed by event '%s'\n", i, string(vm, ev->name));
-					break;
-				}
-			}
+			Variable *dst = t->waittill.arguments[k].u.refval;
+			*dst = ev->arguments[k];
 		}
-		// if(t->state != VM_THREAD_INACTIVE)
-		// {
-		// 	add_thread(vm, t);
-		// }
-		switch(t->state)
+		unsubscribe_thread(vm, t, VM_SUBSCRIPTION_WAITTILL);
+		set_wait_result(vm, t, ev->name);
+		wake_thread(vm, t);
+		t->state = VM_THREAD_ACTIVE;
+		add_thread(vm, t);
+	}
+}
+
+// Events notified before this frame end threads through endon and wake up threads waiting for them
+static void deliver_events(VM *vm)
+{
+	int pending = 0;
+	for(int j = 0; j < vm->event_count; j++)
+	{
+		if(vm->events[j].frame != vm->frame)
+			pending++;
+	}
+	if(pending == 0)
+		return;
+	// All endons go first, a thread that is ended doesn't get woken up by an event in the same frame
+	for(int j = 0; j < vm->event_count; j++)
+	{
+		VMEvent *ev = &vm->events[j];
+		if(ev->frame != vm->frame)
+			end_threads(vm, ev);
+	}
+	// Events notified from outside of a frame are kept until the next one
+	int n = 0;
+	for(int j = 0; j < vm->event_count; j++)
+	{
+		VMEvent *ev = &vm->events[j];
+		if(ev->frame == vm->frame)
 		{
-			case VM_THREAD_WAITING_TIME:
-			{
-				if(t->wait <= 0.f)
-				{
-					t->state = VM_THREAD_ACTIVE;
-					// printf("Thread %d resumed after wait\n", i);
-				}
-				t->wait -= dt;
-			}
-			break;
+			vm->events[n++] = *ev;
+			continue;
+		}
+		wake_waiters(vm, ev);
+	}
+	vm->event_count = n;
+}
 
-			case VM_THREAD_WAITING_FRAME:
-			{
-				t->state = VM_THREAD_ACTIVE;
-			}
-			break;
+static int effective_priority(Thread *t)
+{
+	if(t->deferred < VM_PRIORITY_AGING_FRAMES || t->priority == GSC_PRIORITY_HIGH)
+		return t->priority;
+	return t->priority - 1;
+}
 
-			case VM_THREAD_INACTIVE:
-			{
-				// TODO: cleanup
-				// for(size_t k = 0; k < t->bp; ++k)
-				// {
-				// 	StackFrame *sf = &t->frames[--t->bp];
-				// 	buf_free(sf->locals);
-				// }
-				object_pool_deallocate(&vm->pool.threads, t);
-				t = NULL;
-			}
-			break;
+static void begin_frame(VM *vm)
+{
+	// Threads woken up last frame run this frame, in the order they were created
+	VMThreadList running = vm->activated;
+	vm->activated = vm->running;
+	vm->activated.count = 0;
+	vm->running = running;
+
+	VMThreadList *frame_waiters = &vm->frame_waiters;
+	for(int i = 0; i < frame_waiters->count; ++i)
+	{
+		Thread *t = frame_waiters->items[i];
+		// Killed while it was waiting, kill_thread leaves queued threads to be freed here
+		if(t->state == VM_THREAD_INACTIVE)
+		{
+			t->queued = false;
+			free_thread(vm, t);
+			continue;
+		}
+		t->state = VM_THREAD_ACTIVE;
+		add_thread(vm, t);
+	}
+	frame_waiters->count = 0;
 
-			case VM_THREAD_ACTIVE:
-			{
-				vm->thread = t;
-				run_thread(vm);
-				vm->thread = &vm->temp_thread;
-			}
-			break;
+	fire_timers(vm);
+	deliver_events(vm);
 
-			case VM_THREAD_WAITING_EVENT:
-			{
-				// for(size_t j = 0; j < vm->event_count; j++)
-				for(size_t j = 0; j < VM_MAX_EVENTS_PER_FRAME; j++)
-				{
-					VMEvent *ev = &vm->events[j];
-					if(ev->frame == -1 || ev->frame == vm->frame)
-						continue;
-					if(ev->name == t->waittill.name && ev->object == t->waittill.object)
-					{
-						int min = t->waittill.numargs;
-						if(ev->numargs < min)
-							min = ev->numargs;
-						for(int k = 0; k < min; k++)
-						{
-							Variable *dst = t->waittill.arguments[k].u.refval;
-							Variable *src = &ev->arguments[k];
-							dst->type = src->type;
-							memcpy(&dst->u, &src->u, sizeof(dst->u));
-						}
-						t->state = VM_THREAD_ACTIVE;
-						// printf("Thread %d resumed on event '%s'\n", i, string(vm, ev->name));
-					}
-				}
-			}
+	// Threads that are woken up now run next frame
+	while(vm->sleeping.count > 0)
+	{
+		Thread *t = vm->sleeping.items[0];
+		if(t->wake_time > vm->time + 1e-6)
 			break;
+		wake_thread(vm, t);
+		// Timed out waiting for events
+		if(t->state == VM_THREAD_WAITING_EVENT)
+		{
+			unsubscribe_thread(vm, t, VM_SUBSCRIPTION_WAITTILL);
+			set_wait_result(vm, t, vm->string_index.timeout);
 		}
-		
-		if(t)
-			add_thread(vm, t);
+		t->state = VM_THREAD_ACTIVE;
+		add_thread(vm, t);
 	}
 
-	for(size_t j = 0; j < VM_MAX_EVENTS_PER_FRAME; j++)
+	for(int i = 0; i < vm->running.count; ++i)
 	{
-		VMEvent *ev = &vm->events[j];
-		if(ev->frame == -1 || ev->frame == vm->frame)
+		Thread *t = vm->running.items[i];
+		t->run_priority = effective_priority(t);
+		if(t->run_priority != t->priority)
+			vm->priority_stats[t->priority].promoted++;
+	}
+	qsort(vm->running.items, vm->running.count, sizeof(Thread *), compare_thread_priority);
+	vm->run_index = 0;
+	vm->frame_started = true;
+}
+
+// Low priority threads that are left when the budget runs out are pushed to the next frame
+static void defer_threads(VM *vm)
+{
+	int n = vm->run_index;
+	for(int i = vm->run_index; i < vm->running.count; ++i)
+	{
+		Thread *t = vm->running.items[i];
+		// Promoted threads are deferred as well, they keep their place in front of the others
+		if(t->priority < GSC_PRIORITY_LOW || t->state != VM_THREAD_ACTIVE)
+		{
+			vm->running.items[n++] = t;
 			continue;
-		free_event(ev);
+		}
+		if(t == vm->preempted)
+			vm->preempted = NULL;
+		t->deferred++;
+		vm->threads_deferred++;
+		vm->priority_stats[t->priority].deferred++;
+		thread_list_push(vm, &vm->activated, t);
 	}
-	
-	// vm->event_count = 0; // Reset for next frame
+	vm->running.count = n;
+}
+
+static void end_frame(VM *vm, float dt)
+{
+	vm->running.count = 0;
+	vm->run_index = 0;
+	vm->frame_started = false;
+
+	vm->time += dt;
 	vm->frame++;
-	return vm->thread_read_idx != vm->thread_write_idx;
+}
+
+void vm_set_thread_priority(VM *vm, Thread *t, int priority)
+{
+	if(priority < GSC_PRIORITY_HIGH || priority >= GSC_PRIORITY_MAX)
+		vm_error(vm, "Invalid thread priority %d", priority);
+	t->priority = priority;
+}
+
+// Returns false once there are no threads left, check vm->preempted for whether the frame finished
+bool vm_run_threads(VM *vm, float dt)
+{
+	if(!vm->frame_started)
+		begin_frame(vm);
+	vm->threads_run = 0;
+	vm->threads_deferred = 0;
+	vm->out_of_budget = NULL;
+	for(; vm->run_index < vm->running.count; ++vm->run_index)
+	{
+		Thread *t = vm->running.items[vm->run_index];
+		bool resumed = vm->preempted == t;
+		vm->preempted = NULL;
+		t->queued = false;
+		if(t->state != VM_THREAD_ACTIVE)
+		{
+			free_thread(vm, t);
+			continue;
+		}
+		if(!resumed)
+		{
+			t->instructions = 0;
+			vm->priority_stats[t->priority].runs++;
+		}
+		vm->threads_run++;
+		vm->thread = t;
+		int64_t instructions = vm->instructions;
+		run_thread(vm);
+		vm->priority_stats[t->priority].instructions += vm->instructions - instructions;
+		vm->thread = &vm->temp_thread;
+		// Stays in the running list and is resumed first on the next run
+		if(vm->preempted)
+		{
+			t->queued = true;
+			vm->out_of_budget = t;
+			defer_threads(vm);
+			if(vm->run_index < vm->running.count)
+				return true;
+			end_frame(vm, dt);
+			return vm->thread_count > 0;
+		}
+		// Stays promoted until it gets to finish a run
+		t->deferred = 0;
+		switch(t->state)
+		{
+			case VM_THREAD_INACTIVE: free_thread(vm, t); break;
+			case VM_THREAD_ACTIVE: add_thread(vm, t); break;
+			case VM_THREAD_WAITING_FRAME:
+				t->queued = true;
+				thread_list_push(vm, &vm->frame_waiters, t);
+				break;
+			// The wait starts counting down next frame
+			case VM_THREAD_WAITING_TIME: sleep_thread(vm, t, vm->time + dt + t->wait); break;
+			case VM_THREAD_WAITING_EVENT:
+				if(t->timeout >= 0.f)
+					sleep_thread(vm, t, vm->time + dt + t->timeout);
+				break;
+			// Not in any list until vm_async_complete
+			case VM_THREAD_WAITING_ASYNC: break;
+		}
+	}
+	end_frame(vm, dt);
+	return vm->thread_count > 0;
 }
@@ -7,7 +7,7 @@
 #include "instruction.h"
 #include "allocator.h"
 #include "hash_trie.h"
-#include "object_pool.h"
+#include "slab.h"
 #include "string_table.h"
 #include "include/gsc.h"
 
@@ -54,6 +54,7 @@ enum { sizeof_ObjectField = sizeof(ObjectField) };
 // I guess I could change it in the future if need be, considering object prototypes are more powerful
 
 typedef struct Object Object;
+typedef struct Thread Thread;
 
 typedef struct
 {
@@ -75,18 +76,20 @@ struct Object
     // Object *base;
     Object *proxy;
     gsc_DebugInfo debug_info;
+    Thread *threads; // Threads running with this object as self
+    int timer_count; // Timers notifying this object
 };
 enum { sizeof_Object = sizeof(Object) };
 
 ObjectField *vm_object_upsert(VM *vm, Object *obj, const char *key);
 
+#pragma pack(push, 1)
 typedef struct
 {
-    size_t length;
     char *data;
+    uint32_t length;
 } VariableString;
 
-#pragma pack(push, 1)
 typedef union
 {
     int64_t ival;
@@ -116,25 +119,43 @@ enum { sizeof_VariableValue = sizeof(VariableValue) };
 // #define VAR_FLAG_NONE (0)
 // #define VAR_FLAG_NO_FREE (1)
 
+// The value is packed, aligning it keeps the pointers inside it on 8 bytes, the whole thing fits in 16 bytes
 #pragma pack(push, 8)
 struct Variable
 {
+	_Alignas(8) VariableValue u;
 	int type;
     // int flags;
     // int refcount;
-	VariableValue u;
     // Variable *next;
 };
 #pragma pack(pop)
 
 enum { sizeof_Variable = sizeof(Variable) };
+_Static_assert(sizeof(Variable) == 16, "Variable should be 16 bytes");
+_Static_assert(_Alignof(Variable) == 8, "Variable should be 8 byte aligned");
 
 #define VM_MAX_LOCALS (256)
 
+// Locals of all frames of a thread live on a stack of segments, every frame gets one contiguous block
+// Segments never move so references to locals stay valid for as long as the frame is alive
+#define VM_LOCALS_SEGMENT_SIZE (32)
+
+typedef struct VMLocalsSegment VMLocalsSegment;
+
+struct VMLocalsSegment
+{
+    VMLocalsSegment *prev, *next;
+    int capacity;
+    int used;
+    Variable values[];
+};
+
 #pragma pack(push, 8)
 typedef struct
 {
-    Variable *locals[VM_MAX_LOCALS]; // TODO: FIXME
+    Variable *locals;
+    VMLocalsSegment *locals_segment;
     int local_count;
     Instruction *instructions;
     int instruction_count;
@@ -163,36 +184,138 @@ typedef enum
 	VM_THREAD_ACTIVE,
 	VM_THREAD_WAITING_TIME,
 	VM_THREAD_WAITING_FRAME,
-	VM_THREAD_WAITING_EVENT
+	VM_THREAD_WAITING_EVENT,
+	VM_THREAD_WAITING_ASYNC // Parked by a native function until the host completes its token
 } VMThreadState;
 
 static const char *vm_thread_state_names[] = { "INACTIVE",		"ACTIVE",		 "WAITING_TIME",
-											   "WAITING_FRAME", "WAITING_EVENT", NULL };
-
-#define VM_STACK_SIZE (64)
-#define VM_FRAME_SIZE (16)
+											   "WAITING_FRAME", "WAITING_EVENT", "WAITING_ASYNC", NULL };
+
+// Value and frame stacks start small and double when they run out, the maximums only guard against runaway recursion
+#define VM_STACK_SIZE (16)
+#define VM_MAX_STACK_SIZE (4096)
+#define VM_FRAME_SIZE (4)
+#define VM_MAX_FRAME_SIZE (256)
+// Free stack slots guaranteed to native functions, so pointers from vm_argv stay valid while they push results
+#define VM_NATIVE_STACK_RESERVE (16)
+#define VM_MAX_TYPED_ARGUMENTS (8)
 // #define VM_THREAD_POOL_SIZE (2048)
 // #define VM_THREAD_POOL_SIZE (8192)
 
-#define VM_MAX_ENDON_STRINGS (8)
+typedef struct VMWaitList VMWaitList;
+typedef struct VMSubscription VMSubscription;
 
+typedef enum
+{
+	VM_SUBSCRIPTION_WAITTILL,
+	VM_SUBSCRIPTION_ENDON,
+	VM_SUBSCRIPTION_TIMER, // Cancels a timer
+	VM_SUBSCRIPTION_MAX
+} VMSubscriptionKind;
+
+// A thread waiting for an event on an object, or a timer that is cancelled by it
+struct VMSubscription
+{
+    union
+    {
+        Thread *thread;
+        int timer;
+    };
+    VMWaitList *list;
+    VMSubscription *prev, *next; // In the wait list
+    VMSubscription *thread_next; // In the thread's subscriptions
+    int kind;
+};
+
+// Threads subscribed to a (object, event name) pair, looked up through a hash table when the event is notified
+struct VMWaitList
+{
+    Object *object;
+    int name;
+    VMSubscription *head[VM_SUBSCRIPTION_MAX];
+    VMWaitList *next; // In the hash bucket
+};
+
+// Notifies an event on an object after a delay, and then every period if it has one
 typedef struct
 {
+    double due;
+    float period; // 0 for a one shot
+    Object *object;
+    int name;
+    uint32_t generation; // Bumped every time the slot is reused, so stale ids don't cancel another timer
+    int heap_index; // -1 if the slot is free
+    int next_free;
+    VMSubscription *endon;
+} VMTimer;
+
+// Reference to an object held by the host, the object is pinned for as long as the handle lives
+typedef struct
+{
+    Object *object; // NULL if the slot is free
+    int refcount;
+    uint32_t generation; // Bumped every time the slot is reused, so stale handles don't resolve to another object
+    int next_free;
+} VMHandle;
+
+// Work a native function started for a thread, the thread sleeps until the host completes it
+typedef struct
+{
+    Thread *thread; // NULL if the slot is free
+    uint32_t generation; // Bumped every time the slot is reused, so a late completion doesn't resume another thread
+    int next_free;
+} VMAsync;
+
+// Field or event name resolved once by the host, so the string isn't interned and hashed again on every use
+typedef struct
+{
+    const char *string; // Interned
+    int index; // In the string table
+    uint64_t hash; // Case insensitive, same as the object field tries
+} VMKey;
+
+struct Thread
+{
+    Thread *next_free; // Finished threads are kept with their stacks for reuse
     VMThreadState state;
-    Variable stack[VM_STACK_SIZE]; // Make pointers?
-    StackFrame frames[VM_FRAME_SIZE];
+    Variable *stack;
+    int stack_size;
+    StackFrame *frames;
+    int frame_size;
     // StackFrame *frame;
     int sp, bp;
     int result;
     float wait;
     VMEvent waittill;
-    int endon[VM_MAX_ENDON_STRINGS];
-    int endon_string_count;
     struct{
 		const char *file, *function;
 	} caller;
     Variable *return_value;
-} Thread;
+    VMLocalsSegment *locals; // Segment the top frame's locals are in
+    uint32_t id; // Order threads were created in, threads that are ready run in this order
+    Thread *prev, *next; // List of all threads that are alive
+    double wake_time;
+    int heap_index; // Position in the sleeping heap, -1 if not sleeping
+    bool queued; // In one of the lists of threads waiting to run
+    int invoking; // Nested vm_invoke calls it's suspended in, it's freed once it's running again
+    VMSubscription *subscriptions;
+    Object *owner; // Self of the thread
+    Thread *owner_prev, *owner_next;
+    int64_t instructions; // Executed this frame
+    int priority;
+    int run_priority; // Priority it runs with this frame, raised when it's deferred too often
+    int deferred; // Frames in a row it was deferred
+    float timeout; // Waiting for events gives up after this, negative for no timeout
+    bool return_event; // The name of the event that woke it up is the result of the wait
+    int async; // Slot of the VMAsync it waits for, -1 if none
+};
+
+typedef struct
+{
+    Thread **items;
+    int count;
+    int capacity;
+} VMThreadList;
 
 enum { sizeof_Thread = sizeof(Thread) };
 
@@ -209,20 +332,76 @@ enum { sizeof_Thread = sizeof(Thread) };
 #define VM_FLAG_NONE (0)
 #define VM_FLAG_VERBOSE (1)
 
-#define VM_MAX_EVENTS_PER_FRAME (1024)
+// Pools start out small and grow on demand up to their maximum
+#define VM_INITIAL_THREAD_LIST_SIZE (16)
+#define VM_INITIAL_EVENT_COUNT (16)
+#define VM_INITIAL_WAIT_LIST_COUNT (64)
+#define VM_INITIAL_TIMER_COUNT (16)
+#define VM_INITIAL_HANDLE_COUNT (64)
+#define VM_INITIAL_KEY_COUNT (64)
+#define VM_INITIAL_ASYNC_COUNT (16)
+
+typedef enum
+{
+	VM_SLAB_VARIABLE,
+	VM_SLAB_OBJECT_FIELD,
+	VM_SLAB_OBJECT,
+	VM_SLAB_STRING_16,
+	VM_SLAB_STRING_32,
+	VM_SLAB_STRING_64,
+	VM_SLAB_LOCALS,
+	VM_SLAB_LOCALS_LARGE,
+	VM_SLAB_WAIT_LIST,
+	VM_SLAB_SUBSCRIPTION,
+	VM_SLAB_MAX
+} VMSlabClass;
+
+#define VM_MAX_SLAB_STRING_LENGTH (64)
+
+// Threads that were deferred this many frames in a row run a priority class higher until they finish a run
+#define VM_PRIORITY_AGING_FRAMES (4)
 
 struct VM
 {
     jmp_buf *jmp;
     int max_threads;
-    Thread **thread_buffer;//[VM_THREAD_POOL_SIZE];
-    int thread_read_idx;
-    int thread_write_idx;
+    Thread *threads; // All threads that are alive
+    int thread_count;
+    uint32_t thread_id;
+
+    // Only threads that are woken up are touched each frame, sleeping threads wait in a min-heap keyed by wake time
+    VMThreadList activated; // Run next frame
+    VMThreadList frame_waiters; // Waiting for the next frame, activated during the next frame
+    VMThreadList running;
+    VMThreadList sleeping;
+    double time;
     
-    // size_t thread_count;
     Thread *thread;
     Thread temp_thread;
-    VMEvent events[VM_MAX_EVENTS_PER_FRAME];
+    VMEvent *events; // Notified events, delivered at the start of the next frame
+    int event_count;
+    int event_capacity;
+    VMWaitList **wait_lists; // Hash table of wait lists
+    int wait_list_count;
+    int wait_list_capacity;
+    VMTimer *timers;
+    int *timer_heap; // Indices of the timers that are set, ordered by when they're due
+    int timer_count;
+    int timer_capacity;
+    int free_timer; // -1 if there are no free slots
+    VMHandle *handles;
+    int handle_count;
+    int handle_capacity;
+    int free_handle; // -1 if there are no free slots
+    VMAsync *asyncs;
+    int async_count;
+    int async_capacity;
+    int free_async; // -1 if there are no free slots
+    VMKey *keys;
+    int key_count;
+    int key_capacity;
+    HashTrie key_lookup; // Name to key index + 1
+    int native_fields_key; // __fields of proxies, see vm_bind_native_field
     // size_t event_count;
 	int flags;
     // Variable globals[VAR_GLOB_MAX];
@@ -232,21 +411,21 @@ struct VM
 	// Arena arena;
     Allocator *allocator;
 	Arena c_function_arena;
+	ArenaInfo c_function_arena_info;
     uint32_t random_state; // xorshift1 state
 
-    // Memory pools
-    struct
-    {
-        ObjectPool threads;
-        ObjectPool stack_frames;
-        // ObjectPool object_fields;
-        // ObjectPool variables;
-        // ObjectPool objects;
-        ObjectPool uo;
-	} pool;
+    Thread *free_threads;
+    int free_thread_count;
+    Thread *scratch_threads; // Free threads for vm_invoke
+    int64_t threads_spawned;
+    int64_t batch_spawned; // By gsc_spawn_threads
+    double batch_spawn_ms;
+    int thread_total; // Threads allocated, both running and free
+	Slab slab; // Objects, fields, variables and short strings
 	void *ctx;
     StringTable *strings;
     HashTrie callback_functions;
+    uint32_t intrinsics; // Bit per Intrinsic the host allows gsc_link to lower calls to
     // HashTrie callback_methods;
 	CompiledFunction *(*func_lookup)(void *ctx, const char *file, const char *function);
 
@@ -254,13 +433,28 @@ struct VM
 
     int nargs, fsp;
 
-    // struct
-    // {
-    //     int __call;
-    // } string_index;
+    struct
+    {
+        // int __call;
+        int timeout;
+    } string_index;
 
     int frame;
     char default_self[64];
+
+    // A frame can be stopped part way when the budget runs out and is picked up again on the next run
+    bool frame_started;
+    int run_index; // Next thread to run in running
+    Thread *preempted; // Stopped at a safe point, continues where it left off
+    int threads_run; // By the last call to vm_run_threads
+    int threads_deferred; // Pushed to the next frame by the last call to vm_run_threads
+    Thread *out_of_budget; // Thread that was running when the last call to vm_run_threads ran out of budget
+    int64_t instructions; // Executed in total
+    int64_t instruction_limit; // Check the budget at the next safe point once instructions reaches this
+    int64_t instruction_budget_end;
+    double deadline; // In milliseconds of vm_clock_ms, 0 for none
+    int call_priority; // Priority of threads started from outside of a thread
+    gsc_PriorityStats priority_stats[GSC_PRIORITY_MAX];
 };
 
 // typedef struct
@@ -270,13 +464,37 @@ struct VM
 // } VMContext;
 
 bool vm_call_function_thread(VM *vm, const char *file, const char *function, size_t nargs, Variable *self);
+void vm_invoke(VM *vm, CompiledFunction *vmf, size_t nargs, Variable *self);
+void vm_spawn_threads(VM *vm, CompiledFunction *vmf, Object **objects, int count, int nargs, void (*push_arguments)(void *ctx, int index, void *userdata), void *userdata);
 // bool vm_run(VM *vm, float dt);
 bool vm_run_threads(VM *vm, float dt);
+void vm_set_budget(VM *vm, int64_t max_instructions, double max_time_ms);
+void vm_set_thread_priority(VM *vm, Thread *t, int priority);
+double vm_clock_ms(void);
+void vm_subscribe(VM *vm, Thread *thr, Object *object, int name, VMSubscriptionKind kind);
+void vm_wait_any(VM *vm, Thread *thr, float timeout);
+int64_t vm_add_timer(VM *vm, Object *object, int name, float delay, float period, int endon);
+bool vm_cancel_timer(VM *vm, int64_t id);
+int64_t vm_create_handle(VM *vm, Object *object);
+Object *vm_handle_object(VM *vm, int64_t id);
+bool vm_retain_handle(VM *vm, int64_t id);
+bool vm_release_handle(VM *vm, int64_t id);
+int64_t vm_async_begin(VM *vm);
+bool vm_async_complete(VM *vm, int64_t token, Variable *result);
+int vm_key(VM *vm, const char *name);
+int vm_key_string_index(VM *vm, int key);
+void vm_bind_native_field(VM *vm, Object *proxy, const char *name, int type, size_t offset, int flags);
+void vm_get_field_key(VM *vm, Variable *ov, int key);
+void vm_set_field_key(VM *vm, Variable *ov, int key);
+void vm_scatter_field(VM *vm, Object **objects, int count, int key, int type, const char *data, size_t stride);
+int vm_gather_field(VM *vm, Object **objects, int count, int key, int type, char *data, size_t stride);
+void vm_kill_object_threads(VM *vm, Object *object);
 void vm_init(VM *vm, Allocator *allocator, StringTable *strtab, const char *default_self, int max_threads);
 void vm_cleanup(VM*);
 
 void vm_register_callback_function(VM *vm, const char *name, void *callback, void *ctx);
 void vm_register_c_function(VM *vm, const char *name, vm_CFunction callback);
+bool vm_register_typed_function(VM *vm, const char *name, const char *signature, gsc_TypedFunction callback, void *ctx);
 
 const char *vm_stringify(VM *vm, Variable *v, char *buf, size_t n);
 size_t vm_argc(VM *vm);
@@ -287,6 +505,9 @@ int vm_pushobject(VM *vm, Object *o);
 Thread *vm_thread(VM*);
 void vm_print_thread_info(VM *vm);
 void vm_notify(VM *vm, Object *object, const char *key, size_t nargs);
+void vm_notify_event(VM *vm, Object *object, int name, Variable *args, int numargs);
+void vm_reserve_events(VM *vm, int count);
+void vm_waittill(VM *vm, Thread *thr, Object *object, int name, Variable *args, int numargs);
 void vm_error(VM *vm, const char *fmt, ...);
 // Variable* vm_dup(VM *vm, Variable* v);
 void vm_set_object_field(VM *vm, int obj_index, const char *key);